@@ -0,0 +1,96 @@
+#pragma once
+
+// A minimal benchmark harness: times a loop of n operations and prints
+// the cost per operation.  Run with --quick for a fast smoke run (the
+// numbers are meaningless then) or --filter=text to run only the groups
+// of benchmarks whose name contains text.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace bench {
+
+   // Keeps the compiler from optimizing away a computed value.
+   template <class T>
+   inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+      asm volatile("" : : "r,m"(value) : "memory");
+#else
+      static const volatile void * sink;
+      sink = &value;
+#endif
+   }
+
+   class runner {
+   public:
+      runner(int argc, char ** argv)
+         : quick_(false) {
+         for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--quick") == 0) {
+               quick_ = true;
+            }
+            else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+               filter_ = argv[i] + 9;
+            }
+         }
+      }
+
+      bool quick() const {
+         return quick_;
+      }
+
+      // Scales an operation count down for quick runs.
+      std::size_t count(std::size_t n) const {
+         return quick_ ? std::max<std::size_t>(n / 1000, 1) : n;
+      }
+
+      // Whether to run the group of benchmarks called name.  Groups are
+      // filtered as a whole, since later benchmarks in a group may rely on
+      // state built by earlier ones.
+      bool selected(const std::string& name) const {
+         return filter_.empty() || name.find(filter_) != std::string::npos;
+      }
+
+      void section(const char * title) const {
+         std::printf("\n%s\n", title);
+      }
+
+      void note(const char * name, const std::string& text) const {
+         std::printf("  %-52s %s\n", name, text.c_str());
+      }
+
+      // Calls body(n) -- which must perform n operations -- a few times and
+      // reports the best time per operation.  setup() runs untimed before
+      // each call.
+      template <class Setup, class Body>
+      void run(const char * name, std::size_t n, Setup&& setup, Body&& body) const {
+         n = count(n);
+         int rounds = quick_ ? 1 : 5;
+         double best = 0;
+         for (int round = 0; round < rounds; ++round) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            body(n);
+            auto stop = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double, std::nano>(stop - start).count() / n;
+            if (round == 0 || ns < best) {
+               best = ns;
+            }
+         }
+         std::printf("  %-52s %10.2f ns/op\n", name, best);
+      }
+
+      template <class Body>
+      void run(const char * name, std::size_t n, Body&& body) const {
+         run(name, n, [] {}, body);
+      }
+
+   private:
+      bool quick_;
+      std::string filter_;
+   };
+}
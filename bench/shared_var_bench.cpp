@@ -0,0 +1,640 @@
+// Microbenchmarks for shared_var: construct, copy, destroy, type checks,
+// access and equality for each kind of held value, plus the comparisons
+// behind the type tag, the two-word layout and the refcount policies.
+
+#include "bench.h"
+#include "../shared_var.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench::do_not_optimize;
+
+namespace {
+
+   typedef std::vector<shared_var> var_vector;
+   typedef std::map<std::string, shared_var> var_map;
+
+   var_map make_document() {
+      var_map doc;
+      doc["id"] = 42;
+      doc["name"] = "document";
+      doc["ratio"] = 0.5;
+      doc["tags"] = var_vector{ shared_var("a"), shared_var("b"), shared_var("c") };
+      return doc;
+   }
+
+   template <class T, class Other>
+   void bench_type(const bench::runner& r, const std::string& name, const T& value, std::size_t n) {
+      if (!r.selected(name)) {
+         return;
+      }
+      var_vector out, copies;
+      auto label = [&](const char * op) { return name + " " + op; };
+
+      r.run(label("construct").c_str(), n,
+         [&] { out.clear(); out.reserve(r.count(n)); },
+         [&](std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+               out.emplace_back(value);
+            }
+         });
+      r.run(label("copy").c_str(), n,
+         [&] { copies.clear(); copies.reserve(out.size()); },
+         [&](std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+               copies.push_back(out[i]);
+            }
+         });
+      r.run(label("is (hit/miss)").c_str(), n, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += out[i].template is<T>();
+            hits += out[i].template is<Other>();
+         }
+         do_not_optimize(hits);
+      });
+      r.run(label("as").c_str(), n, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            do_not_optimize(out[i].template as<T>());
+         }
+      });
+      r.run(label("get_if (miss)").c_str(), n, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += out[i].template get_if<Other>() != nullptr;
+         }
+         do_not_optimize(hits);
+      });
+      r.run(label("as (miss)").c_str(), n, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            do_not_optimize(out[i].template as<Other>());
+         }
+      });
+      // Against values built separately: copies share out's holders, and
+      // == on those stops at the identity check.
+      var_vector separate;
+      r.run(label("equals").c_str(), n,
+         [&] {
+            separate.clear();
+            for (std::size_t i = 0, count = out.size(); i < count; ++i) {
+               separate.emplace_back(value);
+            }
+         },
+         [&](std::size_t count) {
+            std::size_t same = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+               same += out[i] == separate[i];
+            }
+            do_not_optimize(same);
+         });
+      separate.clear();
+      r.run(label("destroy (shared ref)").c_str(), n,
+         [&] { copies.assign(out.begin(), out.end()); },
+         [&](std::size_t) { copies.clear(); });
+      r.run(label("destroy (last ref)").c_str(), n,
+         [&] {
+            out.clear();
+            for (std::size_t i = 0, count = r.count(n); i < count; ++i) {
+               out.emplace_back(value);
+            }
+         },
+         [&](std::size_t) { out.clear(); });
+   }
+
+   void bench_types(const bench::runner& r) {
+      r.section("per held type");
+      bench_type<int, double>(r, "int", 42, 1000000);
+      bench_type<double, int>(r, "double", 3.25, 1000000);
+      bench_type<bool, int>(r, "bool", true, 1000000);
+      bench_type<std::string, int>(r, "string (short)", std::string("short"), 1000000);
+      bench_type<std::string, int>(r, "string (long)", std::string(64, 'x'), 1000000);
+      bench_type<var_vector, var_map>(r, "vector<shared_var>", var_vector{ shared_var(1), shared_var(2.0), shared_var("three") }, 200000);
+      bench_type<var_map, var_vector>(r, "map<string, shared_var>", make_document(), 100000);
+   }
+
+   // The type checks used to be dynamic_cast on a polymorphic holder; this
+   // replicates that scheme as a baseline for the type tag comparison.
+   struct rtti_base {
+      virtual ~rtti_base() {}
+   };
+
+   template <class T>
+   struct rtti_holder : rtti_base {
+      explicit rtti_holder(const T& v) : value(v) {}
+      T value;
+   };
+
+   void bench_type_checks(const bench::runner& r) {
+      if (!r.selected("type checks")) {
+         return;
+      }
+      r.section("type checks: type tag vs dynamic_cast");
+      const std::size_t n = r.count(1000000);
+      std::vector<std::shared_ptr<rtti_base>> rtti;
+      var_vector vars;
+      for (std::size_t i = 0; i < n; ++i) {
+         switch (i % 3) {
+         case 0:
+            rtti.push_back(std::make_shared<rtti_holder<std::string>>("text"));
+            vars.emplace_back(std::string("text"));
+            break;
+         case 1:
+            rtti.push_back(std::make_shared<rtti_holder<var_vector>>(var_vector()));
+            vars.emplace_back(var_vector());
+            break;
+         default:
+            rtti.push_back(std::make_shared<rtti_holder<var_map>>(var_map()));
+            vars.emplace_back(var_map());
+            break;
+         }
+      }
+      r.run("dynamic_cast<holder<std::string>>", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += dynamic_cast<rtti_holder<std::string>*>(rtti[i].get()) != nullptr;
+         }
+         do_not_optimize(hits);
+      });
+      r.run("shared_var::is<std::string>", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += vars[i].is<std::string>();
+         }
+         do_not_optimize(hits);
+      });
+   }
+
+   template <class T>
+   void bench_in_place(const bench::runner& r, const std::string& name, const T& value,
+      std::size_t n) {
+      r.run((name + " from const T& (one copy)").c_str(), n, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            shared_var v(value);
+            do_not_optimize(v);
+         }
+      });
+      r.run((name + " from T(const T&) (copy + move)").c_str(), n, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            shared_var v{ T(value) };
+            do_not_optimize(v);
+         }
+      });
+   }
+
+   void bench_construction(const bench::runner& r) {
+      if (!r.selected("in-place")) {
+         return;
+      }
+      r.section("in-place construction");
+      const std::size_t elements = 10000;
+      bench_in_place(r, "vector<int>", std::vector<int>(elements, 7), 10000);
+      r.run("vector<int> make_var<T>(n, x)", 10000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            shared_var v = make_var<std::vector<int>>(elements, 7);
+            do_not_optimize(v);
+         }
+      });
+      bench_in_place(r, "string", std::string(elements, 'x'), 10000);
+      r.run("string make_var<T>(n, c)", 10000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            shared_var v = make_var<std::string>(elements, 'x');
+            do_not_optimize(v);
+         }
+      });
+      const char * const lengths[] = { "short", "long" };
+      const char * const strings[] = { "short", "a string too long for the small buffer" };
+      for (int k = 0; k < 2; ++k) {
+         const char * chars = strings[k];
+         const std::string name = std::string("const char* (") + lengths[k] + ")";
+         r.run((name + " via temporary").c_str(), 1000000, [&](std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+               shared_var v{ std::string(chars) };
+               do_not_optimize(v);
+            }
+         });
+         r.run((name + " in place").c_str(), 1000000, [&](std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+               shared_var v(chars);
+               do_not_optimize(v);
+            }
+         });
+      }
+   }
+
+   struct kind_of {
+      int operator()(std::nullptr_t) const { return 0; }
+      int operator()(long long) const { return 1; }
+      int operator()(double) const { return 2; }
+      int operator()(bool) const { return 3; }
+      int operator()(const std::string&) const { return 4; }
+      int operator()(const var_vector&) const { return 5; }
+      int operator()(const shared_var&) const { return 6; }
+   };
+
+   void bench_closed_set(const bench::runner& r) {
+      if (!r.selected("closed set")) {
+         return;
+      }
+      r.section("closed set: shared_var_of vs shared_var");
+      typedef shared_var_of<long long, double, bool, std::string, var_vector> message_var;
+      const std::size_t n = r.count(1000000);
+      std::vector<message_var> closed;
+      var_vector open;
+      for (std::size_t i = 0; i < n; ++i) {
+         switch (i % 4) {
+         case 0:
+            closed.emplace_back(static_cast<long long>(i));
+            open.emplace_back(static_cast<long long>(i));
+            break;
+         case 1:
+            closed.emplace_back(0.5);
+            open.emplace_back(0.5);
+            break;
+         case 2:
+            closed.emplace_back(std::string("text"));
+            open.emplace_back(std::string("text"));
+            break;
+         default:
+            closed.emplace_back(true);
+            open.emplace_back(true);
+            break;
+         }
+      }
+      r.run("shared_var_of::is<double>", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += closed[i].is<double>();
+         }
+         do_not_optimize(hits);
+      });
+      r.run("shared_var::is<double>", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += open[i].is<double>();
+         }
+         do_not_optimize(hits);
+      });
+      r.run("visit shared_var_of", 1000000, [&](std::size_t count) {
+         int sum = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            sum += visit(kind_of(), closed[i]);
+         }
+         do_not_optimize(sum);
+      });
+      r.run("visit shared_var", 1000000, [&](std::size_t count) {
+         int sum = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            sum += visit(kind_of(), open[i]);
+         }
+         do_not_optimize(sum);
+      });
+   }
+
+   // The mutex-guarded baseline for atomic_shared_var.
+   class locked_var {
+   public:
+      shared_var load() const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return value_;
+      }
+
+      void store(shared_var v) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         value_ = std::move(v);
+      }
+
+   private:
+      mutable std::mutex mutex_;
+      shared_var value_;
+   };
+
+   // Readers load in a loop while a writer publishes a new snapshot every
+   // 100us.  Reported per load on each reader; flat as readers are added
+   // means reads scale.
+   template <class Cell>
+   void bench_readers(const bench::runner& r, const std::string& name, std::size_t threads) {
+      Cell cell;
+      cell.store(shared_var(make_document()));
+      std::string label = name + " load, " + std::to_string(threads) + " readers";
+      r.run(label.c_str(), 200000, [&](std::size_t count) {
+         std::atomic<bool> done(false);
+         std::thread writer([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+               cell.store(shared_var(make_document()));
+               std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+         });
+         std::vector<std::thread> readers;
+         for (std::size_t t = 0; t < threads; ++t) {
+            readers.emplace_back([&] {
+               for (std::size_t i = 0; i < count; ++i) {
+                  do_not_optimize(cell.load());
+               }
+            });
+         }
+         for (std::thread& reader : readers) {
+            reader.join();
+         }
+         done.store(true);
+         writer.join();
+      });
+   }
+
+   void bench_atomic(const bench::runner& r) {
+      if (!r.selected("atomic")) {
+         return;
+      }
+      r.section("atomic_shared_var vs mutex, readers with one writer");
+      std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+      for (std::size_t threads = 1; ; threads = std::min(threads * 2, cores)) {
+         bench_readers<atomic_shared_var>(r, "atomic_shared_var", threads);
+         bench_readers<locked_var>(r, "mutex + shared_var", threads);
+         if (threads == cores) {
+            break;
+         }
+      }
+   }
+
+   // The cost on the dropping thread of releasing the last reference to a
+   // 100-entry document.
+   void bench_reclaim(const bench::runner& r) {
+      if (!r.selected("reclaim")) {
+         return;
+      }
+      r.section("dropping a document: inline vs deferred");
+      var_map doc;
+      for (int i = 0; i < 100; ++i) {
+         doc["key" + std::to_string(i)] = shared_var(std::string(32, 'x'));
+      }
+      const std::size_t n = r.count(10000);
+      var_vector docs;
+      auto build = [&] {
+         docs.clear();
+         for (std::size_t i = 0; i < n; ++i) {
+            docs.emplace_back(var_map(doc));
+         }
+      };
+      r.run("drop inline", 10000, build, [&](std::size_t) { docs.clear(); });
+
+      shared_var_reclaimer reclaimer;
+      r.run("drop deferred", 10000, [&] { reclaimer.drain(); build(); }, [&](std::size_t) {
+         shared_var_reclaim_scope scope(&reclaimer);
+         docs.clear();
+      });
+      reclaimer.drain();
+      shared_var_reclaimer::stats stats = reclaimer.statistics();
+      r.note("reclaimer max queue depth", std::to_string(stats.max_pending));
+      r.note("reclaimer max lag",
+         std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(stats.max_lag).count()) + " us");
+   }
+
+   void bench_string_compare(const bench::runner& r) {
+      if (!r.selected("compare")) {
+         return;
+      }
+      r.section("comparing with C strings: temporary std::string vs in place");
+      const char * const chars = "a filter value too long for the small string buffer";
+      var_vector vars;
+      for (std::size_t i = 0; i < r.count(100000); ++i) {
+         vars.emplace_back(i % 2 == 0 ? chars : "something else entirely, also long enough");
+      }
+      r.run("== std::string(const char*)", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += vars[i % vars.size()] == std::string(chars);
+         }
+         do_not_optimize(hits);
+      });
+      r.run("== const char*", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += vars[i % vars.size()] == chars;
+         }
+         do_not_optimize(hits);
+      });
+      const std::string_view view(chars);
+      r.run("== std::string_view", 1000000, [&](std::size_t count) {
+         std::size_t hits = 0;
+         for (std::size_t i = 0; i < count; ++i) {
+            hits += vars[i % vars.size()] == view;
+         }
+         do_not_optimize(hits);
+      });
+   }
+
+   void bench_equality(const bench::runner& r) {
+      if (!r.selected("equality")) {
+         return;
+      }
+      r.section("deduplicating 256 byte strings: adjacent ==");
+      const std::size_t n = r.count(100000);
+      var_vector distinct;
+      for (int i = 0; i < 16; ++i) {
+         distinct.emplace_back(std::string(256, 'x') + std::to_string(i));
+      }
+      var_vector copies, separate;
+      for (std::size_t i = 0; i < n; ++i) {
+         copies.push_back(distinct[(i / 4) % distinct.size()]);
+         separate.emplace_back(distinct[(i / 4) % distinct.size()].as<std::string>());
+      }
+      // Counts the runs std::unique would collapse.
+      auto duplicates = [](const var_vector& vars, std::size_t count) {
+         std::size_t dups = 0;
+         for (std::size_t i = 1; i < count; ++i) {
+            dups += vars[i % vars.size()] == vars[(i - 1) % vars.size()];
+         }
+         do_not_optimize(dups);
+      };
+      r.run("equal runs, separate holders", 1000000, [&](std::size_t count) { duplicates(separate, count); });
+      r.run("equal runs, copies (shared holders)", 1000000, [&](std::size_t count) { duplicates(copies, count); });
+
+      // Neighbours always differ, but only in their last characters.
+      var_vector unequal;
+      for (std::size_t i = 0; i < n; ++i) {
+         unequal.emplace_back(distinct[i % distinct.size()].as<std::string>());
+      }
+      r.run("no runs", 1000000, [&](std::size_t count) { duplicates(unequal, count); });
+      for (const shared_var& v : unequal) {
+         v.hash();
+      }
+      r.run("no runs, hashes cached", 1000000, [&](std::size_t count) { duplicates(unequal, count); });
+   }
+
+   void bench_encoding(const bench::runner& r) {
+      if (!r.selected("encoding")) {
+         return;
+      }
+      r.section("binary encoding");
+      var_map doc;
+      for (int i = 0; i < 16; ++i) {
+         doc["record" + std::to_string(i)] = shared_var(make_document());
+      }
+      const shared_var v(doc);
+      std::vector<unsigned char> bytes(shared_var_encode(v, nullptr, 0));
+      r.run("encode (16 record document)", 100000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            do_not_optimize(shared_var_encode(v, bytes.data(), bytes.size()));
+         }
+      });
+      r.run("decode (16 record document)", 100000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            shared_var decoded = shared_var_decode(bytes.data(), bytes.size());
+            do_not_optimize(decoded);
+         }
+      });
+      r.run("build the same document (for scale)", 100000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            var_map built;
+            for (int k = 0; k < 16; ++k) {
+               built["record" + std::to_string(k)] = shared_var(make_document());
+            }
+            do_not_optimize(built);
+         }
+      });
+      r.note("encoded size", std::to_string(bytes.size()) + " bytes");
+   }
+
+   void bench_sort(const bench::runner& r) {
+      if (!r.selected("sort")) {
+         return;
+      }
+      r.section("sorting a million values, per element");
+      const std::size_t n = r.count(1000000);
+      std::mt19937 random(7);
+      std::vector<int> ints(n);
+      var_vector same, mixed;
+      for (std::size_t i = 0; i < n; ++i) {
+         int x = static_cast<int>(random() % 1000000);
+         ints[i] = x;
+         same.emplace_back(x);
+         switch (x % 4) {
+         case 0: mixed.emplace_back(x); break;
+         case 1: mixed.emplace_back(x * 0.5); break;
+         case 2: mixed.emplace_back(x % 2 == 0); break;
+         default: mixed.emplace_back(std::to_string(x)); break;
+         }
+      }
+      std::vector<int> sorted_ints;
+      var_vector sorted;
+      r.run("std::vector<int>", 1000000, [&] { sorted_ints = ints; }, [&](std::size_t) {
+         std::sort(sorted_ints.begin(), sorted_ints.end());
+      });
+      r.run("shared_var, all int", 1000000, [&] { sorted = same; }, [&](std::size_t) {
+         std::sort(sorted.begin(), sorted.end());
+      });
+      r.run("shared_var, int/double/bool/string", 1000000, [&] { sorted = mixed; }, [&](std::size_t) {
+         std::sort(sorted.begin(), sorted.end());
+      });
+   }
+
+   void bench_intern(const bench::runner& r) {
+      if (!r.selected("intern")) {
+         return;
+      }
+      r.section("repeated strings: separate holders vs interned");
+      const std::size_t n = r.count(1000000);
+      std::vector<std::string> statuses;
+      for (int i = 0; i < 8; ++i) {
+         statuses.push_back("status-" + std::to_string(i) + std::string(32, 'x'));
+      }
+      var_vector plain, interned;
+      shared_var_intern_pool pool;
+      for (std::size_t i = 0; i < n; ++i) {
+         plain.emplace_back(statuses[i % statuses.size()]);
+         interned.push_back(pool.intern(shared_var(statuses[i % statuses.size()])));
+      }
+      const shared_var probe = pool.intern(shared_var(statuses[3]));
+      for (const var_vector * vars : { &plain, &interned }) {
+         r.run(vars == &plain ? "== against one value, separate holders" : "== against one value, interned",
+            1000000, [&](std::size_t count) {
+            std::size_t hits = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+               hits += (*vars)[i] == probe;
+            }
+            do_not_optimize(hits);
+         });
+      }
+      r.note("holders, separate", std::to_string(n));
+      r.note("holders, interned", std::to_string(pool.size()));
+   }
+
+   void bench_layout(const bench::runner& r) {
+      if (!r.selected("layout")) {
+         return;
+      }
+      r.section("layout: shared_var vs std::shared_ptr");
+      r.note("sizeof(shared_var)", std::to_string(sizeof(shared_var)) + " bytes");
+      r.note("sizeof(std::shared_ptr<const std::string>)",
+         std::to_string(sizeof(std::shared_ptr<const std::string>)) + " bytes");
+
+      const std::size_t n = r.count(1000000);
+      auto text = std::make_shared<const std::string>(64, 'x');
+      std::vector<std::shared_ptr<const std::string>> ptrs(n, text), ptr_copies;
+      var_vector vars(n, shared_var(*text)), var_copies;
+      r.run("copy std::shared_ptr<const std::string>", 1000000,
+         [&] { ptr_copies.clear(); ptr_copies.reserve(n); },
+         [&](std::size_t count) { ptr_copies.assign(ptrs.begin(), ptrs.begin() + count); });
+      r.run("copy shared_var (string)", 1000000,
+         [&] { var_copies.clear(); var_copies.reserve(n); },
+         [&](std::size_t count) { var_copies.assign(vars.begin(), vars.begin() + count); });
+   }
+
+   template <class Var>
+   void bench_policy(const bench::runner& r, const std::string& name) {
+      typedef std::map<std::string, Var> map_type;
+      const std::size_t n = r.count(1000000);
+      std::vector<Var> vars(n, Var(std::string(64, 'x'))), copies;
+      r.run((name + " copy + destroy (string)").c_str(), 1000000,
+         [&] { copies.reserve(n); },
+         [&](std::size_t count) {
+            copies.assign(vars.begin(), vars.begin() + count);
+            copies.clear();
+         });
+
+      map_type doc;
+      for (int i = 0; i < 16; ++i) {
+         doc["key" + std::to_string(i)] = Var(std::string(32, char('a' + i)));
+      }
+      r.run((name + " copy + destroy (16 key map)").c_str(), 100000, [&](std::size_t count) {
+         for (std::size_t i = 0; i < count; ++i) {
+            map_type copy(doc);
+            do_not_optimize(copy);
+         }
+      });
+   }
+
+   void bench_policies(const bench::runner& r) {
+      if (!r.selected("refcount")) {
+         return;
+      }
+      r.section("refcount policies");
+      bench_policy<shared_var>(r, "atomic_refcount");
+      bench_policy<basic_shared_var<local_refcount>>(r, "local_refcount");
+      bench_policy<basic_shared_var<biased_refcount>>(r, "biased_refcount");
+   }
+}
+
+int main(int argc, char ** argv) {
+   bench::runner r(argc, argv);
+   bench_types(r);
+   bench_type_checks(r);
+   bench_construction(r);
+   bench_closed_set(r);
+   bench_layout(r);
+   bench_atomic(r);
+   bench_reclaim(r);
+   bench_sort(r);
+   bench_string_compare(r);
+   bench_intern(r);
+   bench_equality(r);
+   bench_encoding(r);
+   bench_policies(r);
+   return 0;
+}
@@ -15,269 +15,3219 @@
  *
  * Supports assignment (operator=), comparison (operator==),
  * type checking (is<T>()), and type casting (as<T>());
+ * get_if<T>() and get<T>() access the value without a default T.
  * Supports nullptr_t, which is the equivalent of empty.
  *
- * Has special methods for assigning const char *, const wchar_t *.
- * Immutable and shared using std::shared_ptr.
+ * Has special methods for assigning const char *, const wchar_t * and
+ * their string views; each is copied into a std::basic_string.
+ * Compares with C strings and std::basic_string_view in place, and
+ * is<std::string_view>() / as<std::string_view>() look up a held string.
+ * emplace<T>(args...) and make_var<T>(args...) build a value in place;
+ * take<T>() moves it back out when no other var shares it.
+ * Immutable and shared through an intrusively reference counted holder
+ * (mutate<T>() and edit<T>() copy on write);
+ * small trivially copyable values (int, double, bool, ...) are stored
+ * inline and never allocate.  A shared_var is two words: a type pointer
+ * and either the inline value or the holder pointer.
  *
- * No lexicographic comparison operators.
- * No hash function.
+ * shared_var is basic_shared_var<atomic_refcount>.  Single-threaded code
+ * can use basic_shared_var<local_refcount> to skip atomic operations.
+ * basic_shared_var<biased_refcount> skips them on the thread that made
+ * the value, yet may still be shared with other threads.
+ *
+ * Holders come from the global operator new unless a
+ * shared_var_resource_scope points them at a std::pmr::memory_resource,
+ * such as the bundled shared_var_pool.  A shared_var_reclaim_scope moves
+ * the destruction of the values they drop to a background thread.
+ * Requires C++17.
+ *
+ * Hashable through std::hash<shared_var>, so vars can key unordered
+ * containers; the hash of a shared value is computed once and cached in
+ * its holder.
+ *
+ * Totally ordered (operator<, ..., operator<=>, shared_var_less): first by
+ * type rank (see shared_var_type_rank), then by value.
+ *
+ * visit(visitor, var) dispatches on the held type with one indirect call.
+ *
+ * atomic_shared_var is a cell that threads can load from and store to
+ * concurrently; loads are lock-free.
+ *
+ * shared_var_intern_pool makes equal values share one holder, so
+ * repetitive documents keep one copy of each value and interned vars
+ * compare by pointer.
+ *
+ * shared_var_encode() and shared_var_decode() convert documents of the
+ * built-in types to and from a compact tagged binary format.
+ *
+ * shared_var_of<T1, T2, ...> is the same idea over a fixed list of types,
+ * checked at compile time, for paths where the set of types is known.
+ *
+ * Needs no RTTI: held types are identified by a per-type table.  Builds
+ * whose modules each get their own tables (Windows DLLs, hidden
+ * visibility) can define SHARED_VAR_CROSS_MODULE_TYPES to also match
+ * tables by a compile-time name and hash.
  *
  * Not the same as boost::any.  Close though.
  * More analogous to a java Object.
  * 
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#if defined(__cpp_impl_three_way_comparison) && __cpp_impl_three_way_comparison >= 201907L
+#include <compare>
+#endif
 
 template <typename T>
 struct enable_if_char : std::enable_if <
    std::is_same<char, T>::value ||
    std::is_same<wchar_t, T>::value, T > {};
 
+template <class RefCount>
+class basic_shared_var;
+
+template <typename T>
+struct is_shared_var : std::false_type {};
+
+template <class RefCount>
+struct is_shared_var<basic_shared_var<RefCount>> : std::true_type {};
+
+namespace shared_var_detail {
+   // A string view, looked up as the string it views.  Views are never
+   // held: constructing or assigning from one copies it into the string.
+   template <typename T>
+   struct is_string_view : std::false_type {};
+
+   template <class CharT, class Traits>
+   struct is_string_view<std::basic_string_view<CharT, Traits>> : std::true_type {
+      typedef std::basic_string<CharT, Traits> string_type;
+   };
+
+   template <typename T, typename R>
+   using enable_if_view = std::enable_if<is_string_view<T>::value, R>;
+
+   template <typename T, typename R>
+   using enable_if_not_view = std::enable_if<!is_string_view<T>::value, R>;
+
+}
+
 template <typename T>
 struct enable_if_holdable : std::enable_if <
-   !std::is_same<class shared_var, T>::value &&
-   !std::is_same<nullptr_t, T>::value &&
+   !is_shared_var<T>::value &&
+   !shared_var_detail::is_string_view<T>::value &&
+   !std::is_same<std::nullptr_t, T>::value &&
    !std::is_pointer<T>::value &&
    !std::is_array<T>::value &&
    !std::is_const<T>::value &&
    !std::is_reference<T>::value, T > {};
 
-class shared_var {
+// Registered types have a fixed rank.  Vars holding different types order
+// by rank, so the type part of a comparison is an integer compare.  Rank 0
+// is the empty var; unregistered types all share
+// shared_var_unregistered_rank and order among themselves by a hash of
+// their type names (arbitrary, but the same in every build made with
+// the same compiler).
+//
+// Register more types, at global scope, with
+//    SHARED_VAR_REGISTER_TYPE(my_type, shared_var_user_rank + 0)
+// keeping ranks small and unique.
+const int shared_var_user_rank = 32;
+const int shared_var_unregistered_rank = 0x7fffffff;
 
-   class holder_base {
-   public:
-      virtual ~holder_base() {}
-      virtual bool equals(const holder_base * rhs) const = 0;
-   };
+template <typename T>
+struct shared_var_type_rank
+   : std::integral_constant<int, shared_var_unregistered_rank> {};
+
+#define SHARED_VAR_REGISTER_TYPE(T, Rank) \
+   template <> \
+   struct shared_var_type_rank<T> : std::integral_constant<int, (Rank)> {};
+
+SHARED_VAR_REGISTER_TYPE(bool, 1)
+SHARED_VAR_REGISTER_TYPE(char, 2)
+SHARED_VAR_REGISTER_TYPE(signed char, 3)
+SHARED_VAR_REGISTER_TYPE(unsigned char, 4)
+SHARED_VAR_REGISTER_TYPE(wchar_t, 5)
+SHARED_VAR_REGISTER_TYPE(short, 6)
+SHARED_VAR_REGISTER_TYPE(unsigned short, 7)
+SHARED_VAR_REGISTER_TYPE(int, 8)
+SHARED_VAR_REGISTER_TYPE(unsigned int, 9)
+SHARED_VAR_REGISTER_TYPE(long, 10)
+SHARED_VAR_REGISTER_TYPE(unsigned long, 11)
+SHARED_VAR_REGISTER_TYPE(long long, 12)
+SHARED_VAR_REGISTER_TYPE(unsigned long long, 13)
+SHARED_VAR_REGISTER_TYPE(float, 14)
+SHARED_VAR_REGISTER_TYPE(double, 15)
+SHARED_VAR_REGISTER_TYPE(long double, 16)
+SHARED_VAR_REGISTER_TYPE(std::string, 17)
+SHARED_VAR_REGISTER_TYPE(std::wstring, 18)
+
+template <class RefCount>
+struct shared_var_type_rank<std::vector<basic_shared_var<RefCount>>>
+   : std::integral_constant<int, 19> {};
+
+template <class RefCount>
+struct shared_var_type_rank<std::map<std::string, basic_shared_var<RefCount>>>
+   : std::integral_constant<int, 20> {};
+
+namespace shared_var_detail {
+
+   // Values of small, trivially copyable types (int, double, bool, small
+   // PODs) are stored inside the shared_var itself rather than in a
+   // shared holder, so assigning and copying them never allocates and
+   // never touches a reference count.
+   typedef std::aligned_storage<8, 8>::type local_storage;
 
    template <typename T>
-   class holder : public holder_base {
-   public:
-      T value_;
+   struct is_local : std::integral_constant<bool,
+      std::is_trivially_copyable<T>::value &&
+      sizeof(T) <= sizeof(local_storage) &&
+      std::alignment_of<T>::value <= std::alignment_of<local_storage>::value> {};
+
+   inline void hash_combine(std::size_t& seed, std::size_t h) {
+      seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+   }
+
+   template <typename T, typename = void>
+   struct is_range : std::false_type {};
+
+   template <typename T>
+   struct is_range<T, std::void_t<
+      decltype(std::begin(std::declval<const T&>())),
+      decltype(std::end(std::declval<const T&>()))>> : std::true_type {};
+
+   // Unordered containers: equal ones may list their elements in
+   // different orders.
+   template <typename T, typename = void>
+   struct is_unordered : std::false_type {};
+
+   template <typename T>
+   struct is_unordered<T, std::void_t<typename T::hasher>> : std::true_type {};
+
+   template <typename T, typename = void>
+   struct has_less : std::false_type {};
+
+   template <typename T>
+   struct has_less<T, std::void_t<
+      decltype(std::declval<const T&>() < std::declval<const T&>())>> : std::true_type {};
+
+   // Whether T's operator< can actually be instantiated.  Containers and
+   // pairs declare one unconditionally, so look at what they hold.
+   template <typename T, bool Range = is_range<T>::value>
+   struct is_ordered : has_less<T> {};
+
+   template <typename T>
+   struct is_ordered<T, true> : std::integral_constant<bool,
+      has_less<T>::value &&
+      is_ordered<typename std::decay<
+         decltype(*std::begin(std::declval<const T&>()))>::type>::value> {};
+
+   template <typename A, typename B>
+   struct is_ordered<std::pair<A, B>, false> : std::integral_constant<bool,
+      is_ordered<typename std::remove_const<A>::type>::value &&
+      is_ordered<typename std::remove_const<B>::type>::value> {};
+
+   // Whether T is or holds floating point values, whose operator< is not
+   // a strict weak order once NaNs turn up.
+   template <typename T, bool Range = is_range<T>::value>
+   struct has_floating : std::is_floating_point<T> {};
+
+   template <typename T>
+   struct has_floating<T, true> : has_floating<typename std::decay<
+      decltype(*std::begin(std::declval<const T&>()))>::type> {};
+
+   template <typename A, typename B>
+   struct has_floating<std::pair<A, B>, false> : std::integral_constant<bool,
+      has_floating<typename std::remove_const<A>::type>::value ||
+      has_floating<B>::value> {};
+
+   // Three-way compare of two values of the same type.  Types without an
+   // operator< have all their values equivalent.  NaNs order after every
+   // number and equivalent to each other, also inside containers and
+   // pairs, so the order stays total.
+   template <typename T>
+   int compare_value(const T& lhs, const T& rhs) {
+      if constexpr (!is_ordered<T>::value) {
+         return 0;
+      }
+      else if constexpr (std::is_floating_point<T>::value) {
+         if (lhs < rhs) {
+            return -1;
+         }
+         if (rhs < lhs) {
+            return 1;
+         }
+         bool lhs_nan = lhs != lhs, rhs_nan = rhs != rhs;
+         return lhs_nan == rhs_nan ? 0 : (lhs_nan ? 1 : -1);
+      }
+      else if constexpr (!has_floating<T>::value) {
+         return lhs < rhs ? -1 : (rhs < lhs ? 1 : 0);
+      }
+      else if constexpr (is_range<T>::value) {
+         auto l = std::begin(lhs), r = std::begin(rhs);
+         for (; l != std::end(lhs) && r != std::end(rhs); ++l, ++r) {
+            if (int c = compare_value(*l, *r)) {
+               return c;
+            }
+         }
+         return l != std::end(lhs) ? 1 : (r != std::end(rhs) ? -1 : 0);
+      }
+      else {
+         if (int c = compare_value(lhs.first, rhs.first)) {
+            return c;
+         }
+         return compare_value(lhs.second, rhs.second);
+      }
+   }
 
-      holder(const T& val)
-         : value_(val) {
+   // The name of T as the compiler spells it, taken from the function
+   // signature at compile time.  Only used to identify the type, so the
+   // exact spelling doesn't matter as long as each compiler is consistent.
+   template <typename T>
+   constexpr std::string_view type_name() {
+#if defined(_MSC_VER) && !defined(__clang__)
+      std::string_view sig = __FUNCSIG__;
+      std::size_t first = sig.find("type_name<") + 10;
+      std::size_t last = sig.rfind(">(void)");
+#else
+      std::string_view sig = __PRETTY_FUNCTION__;
+      std::size_t first = sig.find("T = ") + 4;
+      std::size_t last = sig.find("; ", first);
+      if (last == std::string_view::npos) {
+         last = sig.rfind(']');
       }
+#endif
+      return sig.substr(first, last - first);
+   }
 
-      holder(T&& val)
-         : value_(std::move(val)) {
+   // 64-bit FNV-1a.
+   constexpr std::uint64_t name_hash(std::string_view name) {
+      std::uint64_t h = 14695981039346656037ull;
+      for (char c : name) {
+         h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
       }
+      return h;
+   }
+
+   template <typename T>
+   struct type_hash : std::integral_constant<std::uint64_t, name_hash(type_name<T>())> {};
+
+   // Whether a type name can only mean one type in the whole program.
+   // Types in anonymous namespaces and lambdas are private to their
+   // translation unit, so two of them can share a spelling.
+   constexpr bool unique_name(std::string_view name) {
+      return name.find("{anonymous}") == std::string_view::npos &&
+         name.find("(anonymous namespace)") == std::string_view::npos &&
+         name.find("`anonymous namespace'") == std::string_view::npos &&
+         name.find("lambda") == std::string_view::npos;
+   }
+
+   // Whether a type name names a type in namespace std.  MSVC spells
+   // the class key out in front.
+   constexpr bool in_std(std::string_view name) {
+      return name.substr(0, 5) == "std::" ||
+         name.substr(0, 11) == "class std::" ||
+         name.substr(0, 12) == "struct std::";
+   }
+
+   // Whether hash_value(T) is known to agree with T's operator==, so that
+   // different hashes prove two values different: types with a std::hash
+   // (the standard requires it to agree with ==), and standard pairs and
+   // containers of those, whose == compares element by element.  A range
+   // type of one's own may define == any way it likes, so isn't trusted.
+   // shared_var's own std::hash qualifies because hash_value() falls back
+   // to one hash for all values of any type that doesn't.
+   template <typename T, typename = void>
+   struct hash_matches_equals : std::integral_constant<bool,
+      std::is_default_constructible<std::hash<T>>::value> {};
+
+   template <typename T>
+   struct hash_matches_equals<T, std::enable_if_t<
+      !std::is_default_constructible<std::hash<T>>::value && is_range<T>::value>> :
+      std::integral_constant<bool,
+         in_std(type_name<T>()) &&
+         hash_matches_equals<typename std::decay<
+            decltype(*std::begin(std::declval<const T&>()))>::type>::value> {};
+
+   template <typename A, typename B>
+   struct hash_matches_equals<std::pair<A, B>> : std::integral_constant<bool,
+      hash_matches_equals<typename std::remove_const<A>::type>::value &&
+      hash_matches_equals<B>::value> {};
+
+   // Hash of a held value: std::hash<T> when there is one, element by
+   // element for pairs and containers whose hash agrees with == (in any
+   // order for unordered ones), and otherwise the same hash for every
+   // value of T (still correct, just slow in unordered containers).
+   template <typename T>
+   std::size_t hash_value(const T& val);
+
+   template <typename A, typename B>
+   std::size_t hash_value(const std::pair<A, B>& val) {
+      std::size_t seed = hash_value(val.first);
+      hash_combine(seed, hash_value(val.second));
+      return seed;
+   }
 
-      bool equals(const holder_base * rhs) const {
-         const holder<T> * rhs_downcast = dynamic_cast<const holder<T> *>(rhs);
-         if (rhs_downcast != nullptr) {
-            return rhs_downcast->value_ == value_;
+   template <typename T>
+   std::size_t hash_value(const T& val) {
+      if constexpr (std::is_default_constructible<std::hash<T>>::value) {
+         return std::hash<T>()(val);
+      }
+      else if constexpr (!hash_matches_equals<T>::value) {
+         return 0;
+      }
+      else if constexpr (is_unordered<T>::value) {
+         std::size_t sum = 0;
+         for (const auto& element : val) {
+            sum += hash_value(element);
          }
-         return false;
+         std::size_t seed = 0;
+         hash_combine(seed, sum);
+         return seed;
+      }
+      else {
+         std::size_t seed = 0;
+         for (const auto& element : val) {
+            hash_combine(seed, hash_value(element));
+         }
+         return seed;
       }
+   }
+
+   // Everything a shared_var needs to know about a held type at runtime,
+   // one table per held type.  Operations are plain calls through it, and
+   // fast paths can test the flags without making one.  The operations
+   // take the address of a var's storage, which holds either the value
+   // itself (local types) or a pointer to its holder.
+   struct type_desc {
+      std::uint64_t id;
+      std::string_view name;
+      int rank;
+      bool local;
+      bool trivially_copyable;
+      std::size_t size;
+      bool unique_name;
+      // Different cached hashes prove the values different.
+      bool hash_matches_equals;
+      bool (*equals)(const void * lhs, const void * rhs);
+      std::size_t (*hash)(const void * storage);
+      int (*compare)(const void * lhs, const void * rhs);
+      // Destroys and frees the holder; does nothing for local types.
+      void (*destroy)(const void * storage);
    };
 
-   std::shared_ptr<const holder_base> p_;
+   // A type is the same type only if its table is the same table.  That
+   // holds across shared libraries wherever the tables have default
+   // visibility (the linker keeps one), but Windows DLLs and hidden
+   // visibility give each module its own.  Define
+   // SHARED_VAR_CROSS_MODULE_TYPES to also treat tables with the same
+   // name hash and name as one type, except for names that may be
+   // private to a translation unit.
+#if defined(SHARED_VAR_CROSS_MODULE_TYPES)
+   inline bool same_type(const type_desc * lhs, const type_desc * rhs) {
+      return lhs == rhs ||
+         (lhs != nullptr && rhs != nullptr && lhs->unique_name &&
+            lhs->id == rhs->id && lhs->name == rhs->name);
+   }
 
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   void _hold(T&& val) {
-      p_ = std::make_shared<holder<T>>(std::move(val));
+   template <typename T>
+   inline bool is_type(const type_desc * type, const type_desc * table) {
+      return type == table ||
+         (unique_name(type_name<T>()) && type != nullptr &&
+            type->id == type_hash<T>::value && type->name == type_name<T>());
+   }
+#else
+   inline bool same_type(const type_desc * lhs, const type_desc * rhs) {
+      return lhs == rhs;
    }
 
-public:
-   bool _equals(const shared_var& rhs) const {
-      if (p_ == nullptr && rhs.p_ == nullptr) {
-         return true;
+   template <typename T>
+   inline bool is_type(const type_desc * type, const type_desc * table) {
+      return type == table;
+   }
+#endif
+
+   // Three-way order of two types that aren't the same type (nullptr is
+   // the empty var): by rank, then name hash, then name.  Types private
+   // to different translation units can tie on all three; their tables
+   // are still different objects, so order those by address.
+   inline int compare_types(const type_desc * lhs, const type_desc * rhs) {
+      int lhs_rank = lhs == nullptr ? 0 : lhs->rank;
+      int rhs_rank = rhs == nullptr ? 0 : rhs->rank;
+      if (lhs_rank != rhs_rank) {
+         return lhs_rank < rhs_rank ? -1 : 1;
+      }
+      if (lhs->id != rhs->id) {
+         return lhs->id < rhs->id ? -1 : 1;
       }
-      else if (p_ != nullptr && rhs.p_ != nullptr) {
-         return p_->equals(rhs.p_.get());
+      if (lhs->name != rhs->name) {
+         return lhs->name < rhs->name ? -1 : 1;
       }
-      return false;
+      return std::less<const type_desc *>()(lhs, rhs) ? -1 : 1;
    }
 
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   bool _equals_val(const T& rhs) const {
-      if (p_ == nullptr) {
-         return false;
+   // The resource new holders on this thread are allocated from;
+   // nullptr means the global operator new.
+   inline std::pmr::memory_resource *& current_resource() {
+      static thread_local std::pmr::memory_resource * mr = nullptr;
+      return mr;
+   }
+
+   inline void * allocate(std::size_t size, std::size_t align,
+      std::pmr::memory_resource * mr) {
+      if (mr != nullptr) {
+         return mr->allocate(size, align);
+      }
+      if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+         return ::operator new(size, std::align_val_t(align));
       }
-      const shared_var::holder<std::decay<T>::type> * p_downcast =
-         dynamic_cast<const shared_var::holder<std::decay<T>::type> *>(p_.get());
+      return ::operator new(size);
+   }
 
-      if (p_downcast == nullptr) {
-         return false;
+   inline void deallocate(void * p, std::size_t size, std::size_t align,
+      std::pmr::memory_resource * mr) {
+      if (mr != nullptr) {
+         mr->deallocate(p, size, align);
+      }
+      else if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+         ::operator delete(p, std::align_val_t(align));
+      }
+      else {
+         ::operator delete(p);
       }
-      return p_downcast->value_ == rhs;
    }
+}
+
+// Routes every holder created on this thread, while the scope is alive,
+// to the given memory resource:
+//
+//    std::pmr::monotonic_buffer_resource arena;
+//    {
+//       shared_var_resource_scope scope(&arena);
+//       doc = build_document();
+//    }
+//
+// Each holder remembers its resource and gives its memory back to it when
+// the last reference goes, on whatever thread that happens, so the
+// resource has to outlive the vars and be thread-safe if they are shared.
+class shared_var_resource_scope {
 public:
-   shared_var() {
+   explicit shared_var_resource_scope(std::pmr::memory_resource * mr)
+      : prev_(shared_var_detail::current_resource()) {
+      shared_var_detail::current_resource() = mr;
    }
 
-   // Other vars
-
-   shared_var(const shared_var& rhs)
-      : p_(rhs.p_) {
+   ~shared_var_resource_scope() {
+      shared_var_detail::current_resource() = prev_;
    }
 
-   shared_var(shared_var&& val) {
-      p_.swap(val.p_);
-   }
+   shared_var_resource_scope(const shared_var_resource_scope&) = delete;
+   shared_var_resource_scope& operator=(const shared_var_resource_scope&) = delete;
 
-   shared_var& operator=(const shared_var& rhs) {
-      p_ = rhs.p_;
-      return *this;
+private:
+   std::pmr::memory_resource * prev_;
+};
+
+// A size-class pool sized for holders.  Requests of up to max_block bytes
+// are carved out of large chunks and recycled through one free list per
+// 16-byte size class; larger or over-aligned requests go straight to the
+// upstream resource.  release() (or destroying the pool) hands every chunk
+// back at once, so a whole document can be dropped in one go once no var
+// refers into it any more.
+//
+// Not thread-safe: use one pool per thread, or put a
+// std::pmr::synchronized_pool_resource in front of it.
+class shared_var_pool : public std::pmr::memory_resource {
+public:
+   static const std::size_t granularity = 16;
+   static const std::size_t max_block = 256;
+   static const std::size_t chunk_size = 64 * 1024;
+
+   explicit shared_var_pool(
+      std::pmr::memory_resource * upstream = std::pmr::get_default_resource())
+      : upstream_(upstream), chunks_(nullptr), next_(nullptr), end_(nullptr) {
+      for (std::size_t i = 0; i < class_count; ++i) {
+         free_[i] = nullptr;
+      }
    }
 
-   shared_var& operator=(shared_var&& rhs) {
-      p_.swap(rhs.p_);
-      return *this;
+   ~shared_var_pool() {
+      release();
    }
 
-   explicit shared_var(nullptr_t) {
+   shared_var_pool(const shared_var_pool&) = delete;
+   shared_var_pool& operator=(const shared_var_pool&) = delete;
 
+   void release() {
+      while (chunks_ != nullptr) {
+         chunk * next = chunks_->next;
+         upstream_->deallocate(chunks_, chunk_size, granularity);
+         chunks_ = next;
+      }
+      for (std::size_t i = 0; i < class_count; ++i) {
+         free_[i] = nullptr;
+      }
+      next_ = end_ = nullptr;
    }
 
-   shared_var& operator=(nullptr_t) {
-      p_ = nullptr;
-      return *this;
+   std::pmr::memory_resource * upstream_resource() const {
+      return upstream_;
    }
 
-   // C-string special handling
-   template <class CharT, class U = typename enable_if_char<CharT>::type>
-   explicit shared_var(const CharT * rhs) {
-      _hold(std::basic_string<CharT>(rhs));
+protected:
+   void * do_allocate(std::size_t bytes, std::size_t align) override {
+      if (bytes > max_block || align > granularity) {
+         return upstream_->allocate(bytes, align);
+      }
+      std::size_t index = _index(bytes);
+      if (free_[index] != nullptr) {
+         block * b = free_[index];
+         free_[index] = b->next;
+         return b;
+      }
+      std::size_t size = (index + 1) * granularity;
+      if (static_cast<std::size_t>(end_ - next_) < size) {
+         _grow();
+      }
+      void * p = next_;
+      next_ += size;
+      return p;
    }
 
-   template <class CharT, class U = typename enable_if_char<CharT>::type>
-   shared_var& operator=(const CharT * rhs) {
-      _hold(std::basic_string<CharT>(rhs));
-      return *this;
+   void do_deallocate(void * p, std::size_t bytes, std::size_t align) override {
+      if (bytes > max_block || align > granularity) {
+         upstream_->deallocate(p, bytes, align);
+         return;
+      }
+      std::size_t index = _index(bytes);
+      block * b = static_cast<block *>(p);
+      b->next = free_[index];
+      free_[index] = b;
    }
 
-   // generic "holdable" types:
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   explicit shared_var(const T& val) {
-      _hold(T(val));
+   bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
    }
 
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   explicit shared_var(T&& val) {
-      _hold(std::move(val));
-   }   
+private:
+   static const std::size_t class_count = max_block / granularity;
 
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   shared_var& operator=(const T& rhs) {
-      _hold(T(rhs));
+   struct block {
+      block * next;
+   };
+
+   // Chunks are linked through a header in their first size class slot.
+   struct chunk {
+      chunk * next;
+   };
+
+   static std::size_t _index(std::size_t bytes) {
+      return bytes == 0 ? 0 : (bytes - 1) / granularity;
    }
 
-   template <class T, class U = const typename enable_if_holdable<T>::type>
-   shared_var& operator=(T&& rhs) {
-      _hold(std::move(rhs));
-      return *this;
+   void _grow() {
+      char * mem = static_cast<char *>(upstream_->allocate(chunk_size, granularity));
+      chunk * c = reinterpret_cast<chunk *>(mem);
+      c->next = chunks_;
+      chunks_ = c;
+      next_ = mem + granularity;
+      end_ = mem + chunk_size;
    }
 
+   std::pmr::memory_resource * upstream_;
+   block * free_[class_count];
+   chunk * chunks_;
+   char * next_;
+   char * end_;
+};
 
+// Destroys values on a background thread.  While a shared_var_reclaim_scope
+// names a reclaimer, a thread that drops the last reference to a holder
+// only queues it; the reclaimer's thread runs the value's destructor and
+// frees the memory.  That bounds the cost of dropping a large document on
+// a latency-sensitive thread to a lock and a push.
+//
+//    shared_var_reclaimer reclaimer;
+//    ...
+//    shared_var_reclaim_scope scope(&reclaimer);
+//    handle(request);    // whatever it drops is destroyed elsewhere
+//
+// Only vars with a thread-safe refcount policy are deferred.  The
+// holders' memory resources must be thread-safe too, since they are
+// freed from the reclaimer's thread.  Destroying the reclaimer destroys
+// everything still queued.
+class shared_var_reclaimer;
 
-   // as, is, empty
-   template <class T>
-   const T& as() const {
-      const holder<T> * p_downcast = dynamic_cast<const holder<std::decay<T>::type> *>(p_.get());
-      if (p_downcast != nullptr) {
-         return p_downcast->value_;
+namespace shared_var_detail {
+
+   // The reclaimer last references dropped on this thread go to; nullptr
+   // means destroy them right away.
+   inline shared_var_reclaimer *& current_reclaimer() {
+      static thread_local shared_var_reclaimer * r = nullptr;
+      return r;
+   }
+}
+
+class shared_var_reclaimer {
+public:
+   typedef std::chrono::steady_clock clock;
+
+   struct stats {
+      std::size_t pending;          // queued or being destroyed now
+      std::size_t max_pending;
+      std::uint64_t reclaimed;
+      clock::duration max_lag;      // from queueing to destroyed
+      clock::duration total_lag;    // divide by reclaimed for the mean
+   };
+
+   shared_var_reclaimer()
+      : stop_(false), in_flight_(0), stats_() {
+      worker_ = std::thread([this] { _run(); });
+   }
+
+   ~shared_var_reclaimer() {
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         stop_ = true;
       }
-      static const T defaultValue = T();
-      return defaultValue;
+      wake_.notify_one();
+      worker_.join();
    }
 
-   template <class T>
-   const T& as(const T& def) const {
-      const holder<T> * p_downcast = dynamic_cast<const holder<std::decay<T>::type> *>(p_.get());
-      if (p_downcast != nullptr) {
-         return p_downcast->value_;
+   shared_var_reclaimer(const shared_var_reclaimer&) = delete;
+   shared_var_reclaimer& operator=(const shared_var_reclaimer&) = delete;
+
+   // Queues destroy(&holder) to run on the reclaimer's thread.
+   void defer(const void * holder, void (*destroy)(const void *)) {
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         queue_.push_back(item{ holder, destroy, clock::now() });
+         stats_.pending = queue_.size() + in_flight_;
+         stats_.max_pending = std::max(stats_.max_pending, stats_.pending);
       }
-      return def;
+      wake_.notify_one();
    }
 
-   template <class T>
-   bool is() const {
+   // Waits until everything queued so far has been destroyed.
+   void drain() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.wait(lock, [this] { return queue_.empty() && in_flight_ == 0; });
+   }
+
+   stats statistics() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return stats_;
+   }
+
+private:
+   struct item {
+      const void * holder;
+      void (*destroy)(const void *);
+      clock::time_point queued;
+   };
+
+   void _run() {
+      std::vector<item> batch;
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+         wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+         if (queue_.empty()) {
+            return;
+         }
+         batch.swap(queue_);
+         in_flight_ = batch.size();
+         lock.unlock();
+
+         clock::duration max_lag(0), total_lag(0);
+         for (item& it : batch) {
+            it.destroy(&it.holder);
+            clock::duration lag = clock::now() - it.queued;
+            max_lag = std::max(max_lag, lag);
+            total_lag += lag;
+         }
 
-      if (std::_Is_nullptr_t<T>::value) {
-         return p_ == nullptr;
+         lock.lock();
+         stats_.reclaimed += batch.size();
+         stats_.max_lag = std::max(stats_.max_lag, max_lag);
+         stats_.total_lag += total_lag;
+         in_flight_ = 0;
+         stats_.pending = queue_.size();
+         batch.clear();
+         if (queue_.empty()) {
+            idle_.notify_all();
+         }
       }
-      return nullptr != dynamic_cast<const holder<std::decay<T>::type> *>(p_.get());
    }
 
-   bool empty() const {
-      return p_ == nullptr;
+   mutable std::mutex mutex_;
+   std::condition_variable wake_;
+   std::condition_variable idle_;
+   std::vector<item> queue_;
+   bool stop_;
+   std::size_t in_flight_;
+   stats stats_;
+   std::thread worker_;
+};
+
+// Sends the last references dropped on this thread to a reclaimer until
+// the end of the scope.
+class shared_var_reclaim_scope {
+public:
+   explicit shared_var_reclaim_scope(shared_var_reclaimer * r)
+      : prev_(shared_var_detail::current_reclaimer()) {
+      shared_var_detail::current_reclaimer() = r;
+   }
+
+   ~shared_var_reclaim_scope() {
+      shared_var_detail::current_reclaimer() = prev_;
    }
+
+   shared_var_reclaim_scope(const shared_var_reclaim_scope&) = delete;
+   shared_var_reclaim_scope& operator=(const shared_var_reclaim_scope&) = delete;
+
+private:
+   shared_var_reclaimer * prev_;
 };
 
-bool operator==(const shared_var& lhs, const shared_var& rhs) {
-   return lhs._equals(rhs);
-}
+// Thrown by get<T>() when the var doesn't hold a T.
+class bad_shared_var_access : public std::exception {
+public:
+   const char * what() const noexcept override {
+      return "bad shared_var access";
+   }
+};
 
-bool operator!=(const shared_var& lhs, const shared_var& rhs) {
-   return !lhs._equals(rhs);
+// Thrown by shared_var_encode() for a value it cannot encode, and by
+// shared_var_decode() for input that is not a valid encoding.
+class bad_shared_var_format : public std::exception {
+public:
+   const char * what() const noexcept override {
+      return "bad shared_var format";
+   }
+};
+
+namespace shared_var_detail {
+
+   // Kept out of line so get<T>() inlines to a compare and a load.
+   [[noreturn]] inline void throw_bad_access() {
+      throw bad_shared_var_access();
+   }
 }
 
+// Reference counting policies for holders.  A policy supplies a count
+// type that starts at one reference, reports when the last one is
+// released, and says whether it holds the only one; and says whether
+// holders may be shared between threads.  release(holder, destroy) may
+// also answer "not yet" and arrange for destroy(&holder) to be called
+// once the count does reach zero.
 
-// compare with anything.
+// Thread-safe; the default.
+struct atomic_refcount {
+   static constexpr bool thread_safe = true;
 
-template <class T, class U = const typename enable_if_holdable<T>::type>
-bool operator==(const shared_var& lhs, const T& rhs) {
-   return lhs._equals_val(rhs);
-}
+   class count {
+   public:
+      count()
+         : n_(1) {
+      }
 
-template <class T, class U = const typename enable_if_holdable<T>::type>
-bool operator!=(const shared_var& lhs, const T& rhs) {
-   return !lhs._equals_val(rhs);
-}
+      void add_ref() {
+         n_.fetch_add(1, std::memory_order_relaxed);
+      }
 
+      bool release(const void * = nullptr, void (*)(const void *) = nullptr) {
+         return n_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+      }
 
-template <class T, class U = const typename enable_if_holdable<T>::type>
-bool operator==(const T& lhs, const shared_var& rhs) {
-   return rhs._equals_val(lhs);
-}
+      // Acquire, so whatever other owners did before letting go happens
+      // before the caller touches the value.
+      bool unique() const {
+         return n_.load(std::memory_order_acquire) == 1;
+      }
 
-template <class T, class U = const typename enable_if_holdable<T>::type>
-bool operator!=(const T& lhs, const shared_var& rhs) {
-   return !rhs._equals_val(lhs);
-}
+   private:
+      std::atomic<long> n_;
+   };
+};
 
+// Plain integer count, for vars that are created, copied and destroyed on
+// a single thread.  Holders must never be shared with another thread.
+struct local_refcount {
+   static constexpr bool thread_safe = false;
 
-// null pointer.
-bool operator==(nullptr_t, const shared_var& rhs) {
-   return rhs.empty();
-}
+   class count {
+   public:
+      count()
+         : n_(1) {
+      }
 
-bool operator==(const shared_var& lhs, nullptr_t) {
-   return lhs.empty();
-}
+      void add_ref() {
+         ++n_;
+      }
 
-bool operator!=(nullptr_t, const shared_var& rhs) {
-   return !rhs.empty();
-}
+      bool release(const void * = nullptr, void (*)(const void *) = nullptr) {
+         return --n_ == 0;
+      }
 
-bool operator!=(const shared_var& lhs, nullptr_t) {
-   return !lhs.empty();
-}
+      bool unique() const {
+         return n_ == 1;
+      }
 
-// For C-strings
-template <class CharT, class U = typename enable_if_char<CharT>::type>
-bool operator==(const shared_var& lhs, const CharT * rhs) {
-   return lhs == std::basic_string<CharT>(rhs);
-}
+   private:
+      long n_;
+   };
+};
 
-template <class CharT, class U = typename enable_if_char<CharT>::type>
-bool operator==(const CharT * lhs, const shared_var& rhs) {
-   return rhs == std::basic_string<CharT>(lhs);
-}
+// Biased reference counting: the thread that creates a holder counts its
+// own references with plain integer operations, and every other thread
+// uses an atomic shared count.  The two are merged when the owner drops
+// its last reference.  If other threads release references the owner
+// handed them (so the shared count goes negative) the holder is queued
+// on the owner, which merges it the next time it releases anything,
+// calls collect() or exits.  Copies and releases on the creating thread,
+// by far the common case, cost about what local_refcount's do, yet
+// holders may still be shared between threads.
+//
+// Each thread that creates holders gets a small record, freed once the
+// thread has exited and the last holder it created is gone.  A holder
+// queued on its owner is only freed at the owner's next release,
+// collect() or exit.
+struct biased_refcount {
+   static constexpr bool thread_safe = true;
 
-template <class CharT, class U = typename enable_if_char<CharT>::type>
-bool operator!=(const shared_var& lhs, const CharT * rhs) {
-   return !(operator==(lhs, rhs));
-}
+   class count;
 
-template <class CharT, class U = typename enable_if_char<CharT>::type>
-bool operator!=(const CharT * lhs, const shared_var& rhs) {
-   return !(operator==(rhs, lhs));
+   // Merges and, where that drops the last reference, frees the holders
+   // other threads have queued on the calling thread.
+   static void collect() {
+      if (owner * o = current()) {
+         o->drain();
+      }
+   }
+
+private:
+   struct queued {
+      count * c;
+      const void * holder;
+      void (*destroy)(const void *);
+   };
+
+   // One per thread that has created a holder.  Counted by the thread,
+   // while it runs, and by every count it owns.
+   struct owner {
+      std::mutex mutex;
+      std::vector<queued> queue;
+      std::atomic<bool> pending{ false };
+      bool alive;    // written under mutex by the owner only
+      std::atomic<long> users;
+
+      explicit owner(bool running)
+         : alive(running), users(running ? 1 : 0) {
+      }
+
+      void add_user() {
+         users.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void remove_user() {
+         if (users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+         }
+      }
+
+      // False once the owner has exited; the caller merges instead.
+      bool enqueue(const queued& q) {
+         std::lock_guard<std::mutex> lock(mutex);
+         if (!alive) {
+            return false;
+         }
+         queue.push_back(q);
+         pending.store(true, std::memory_order_release);
+         return true;
+      }
+
+      void drain() {
+         std::vector<queued> batch;
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.swap(queue);
+            pending.store(false, std::memory_order_relaxed);
+         }
+         for (queued& q : batch) {
+            if (q.c->_merge_queued()) {
+               q.destroy(&q.holder);
+            }
+         }
+      }
+
+      void exit() {
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            alive = false;
+         }
+         drain();
+      }
+   };
+
+   static owner *& current() {
+      static thread_local owner * o = nullptr;
+      return o;
+   }
+
+   static bool& exited() {
+      static thread_local bool done = false;
+      return done;
+   }
+
+   // The calling thread's record, made on first use.  Holders made while
+   // the thread is being torn down get a record of their own that is
+   // already exited, so every reference to them counts as shared.
+   static owner * this_thread() {
+      struct exit_hook {
+         ~exit_hook() {
+            owner * o = current();
+            current() = nullptr;
+            exited() = true;
+            o->exit();
+            o->remove_user();
+         }
+      };
+      owner * o = current();
+      if (o == nullptr) {
+         if (exited()) {
+            return new owner(false);
+         }
+         o = current() = new owner(true);
+         static thread_local exit_hook hook;
+         (void)hook;
+      }
+      return o;
+   }
+
+public:
+   class count {
+   public:
+      count()
+         : owner_(this_thread()), biased_(1), merged_(false), shared_(0) {
+         owner_->add_user();
+      }
+
+      count(const count&) = delete;
+      count& operator=(const count&) = delete;
+
+      ~count() {
+         owner_->remove_user();
+      }
+
+      void add_ref() {
+         if (_owned()) {
+            ++biased_;
+         }
+         else {
+            shared_.fetch_add(unit, std::memory_order_relaxed);
+         }
+      }
+
+      bool release(const void * holder, void (*destroy)(const void *)) {
+         if (_owned() && owner_->pending.load(std::memory_order_relaxed)) {
+            owner_->drain();   // may merge this count too
+         }
+         if (_owned()) {
+            if (--biased_ != 0) {
+               return false;
+            }
+            merged_ = true;
+            long old = shared_.fetch_or(merged_bit, std::memory_order_acq_rel);
+            return _count(old) == 0 && (old & queued_bit) == 0;
+         }
+         return _release_shared(holder, destroy);
+      }
+
+      bool unique() const {
+         long s = shared_.load(std::memory_order_acquire);
+         if (_owned()) {
+            return biased_ == 1 && _count(s) == 0;
+         }
+         return (s & merged_bit) != 0 && (s & queued_bit) == 0 && _count(s) == 1;
+      }
+
+   private:
+      friend struct biased_refcount;
+
+      // shared_ is the shared count times unit plus two flags: merged (the
+      // biased count has been folded in) and queued (waiting for a merge;
+      // only the merge may then free the holder).
+      static const long unit = 4;
+      static const long merged_bit = 1;
+      static const long queued_bit = 2;
+
+      static long _count(long s) {
+         return (s - (s & (unit - 1))) / unit;
+      }
+
+      bool _owned() const {
+         return owner_ == current() && owner_->alive && !merged_;
+      }
+
+      bool _release_shared(const void * holder, void (*destroy)(const void *)) {
+         long old = shared_.load(std::memory_order_relaxed);
+         long next;
+         do {
+            next = old - unit;
+            if ((next & merged_bit) == 0 && _count(next) < 0) {
+               next |= queued_bit;
+            }
+         } while (!shared_.compare_exchange_weak(old, next,
+            std::memory_order_acq_rel, std::memory_order_relaxed));
+
+         if ((next & merged_bit) != 0) {
+            return _count(next) == 0 && (next & queued_bit) == 0;
+         }
+         if ((next & queued_bit) != 0 && (old & queued_bit) == 0 &&
+            !owner_->enqueue(queued{ this, holder, destroy })) {
+            // The owner has exited, so its biased count is final.
+            std::lock_guard<std::mutex> lock(owner_->mutex);
+            return _merge_queued();
+         }
+         return false;
+      }
+
+      // Folds the biased count into the shared one and clears queued.
+      // Only called by the owner, or once the owner has exited.
+      bool _merge_queued() {
+         long add = biased_ * unit;
+         biased_ = 0;
+         merged_ = true;
+         long old = shared_.load(std::memory_order_relaxed);
+         long next;
+         do {
+            next = ((old | merged_bit) & ~queued_bit) + add;
+         } while (!shared_.compare_exchange_weak(old, next,
+            std::memory_order_acq_rel, std::memory_order_relaxed));
+         return _count(next) == 0;
+      }
+
+      owner * const owner_;
+      long biased_;
+      bool merged_;
+      std::atomic<long> shared_;
+   };
+};
+
+template <class RefCount>
+class basic_shared_var {
+
+   // Holders carry their own reference count (kept as the RefCount policy
+   // says), so a reference to one is a single pointer and copying it
+   // touches only the holder's cache line.
+   class holder_base {
+   public:
+      mutable typename RefCount::count refs_;
+
+      // Where this holder's memory came from; nullptr for operator new.
+      std::pmr::memory_resource * const mr_;
+
+      // The value's hash, computed on first use; 0 until then.  Shared
+      // holders are immutable, and writing to an unshared one clears it.
+      mutable std::atomic<std::size_t> hash_;
+
+      // Shared constants that are never freed; their count is never touched.
+      const bool immortal_;
+
+      // The shared_var_intern_pool this holder is interned in, if any.
+      // Two holders interned in the same pool hold different values.
+      mutable std::atomic<const void *> interned_;
+
+      holder_base(std::pmr::memory_resource * mr, bool immortal)
+         : mr_(mr), hash_(0), immortal_(immortal), interned_(nullptr) {
+      }
+
+      void add_ref() const {
+         if (!immortal_) {
+            refs_.add_ref();
+         }
+      }
+
+      // True once the last reference is gone; the caller then destroys
+      // the holder with destroy, the type table's.
+      bool release(void (*destroy)(const void *)) const {
+         return !immortal_ && refs_.release(this, destroy);
+      }
+
+      bool unique() const {
+         return !immortal_ && refs_.unique();
+      }
+   };
+
+   template <typename T>
+   class holder : public holder_base {
+   public:
+      T value_;
+
+      template <class... Args>
+      holder(std::pmr::memory_resource * mr, bool immortal, Args&&... args)
+         : holder_base(mr, immortal), value_(std::forward<Args>(args)...) {
+      }
+
+      // Constructs the value in place, in memory from the thread's current
+      // resource.
+      template <class... Args>
+      static const holder * create(Args&&... args) {
+         std::pmr::memory_resource * mr = shared_var_detail::current_resource();
+         void * mem = shared_var_detail::allocate(sizeof(holder), alignof(holder), mr);
+         try {
+            return new (mem) holder(mr, false, std::forward<Args>(args)...);
+         }
+         catch (...) {
+            shared_var_detail::deallocate(mem, sizeof(holder), alignof(holder), mr);
+            throw;
+         }
+      }
+
+      // A holder that lives until the process exits.  It is deliberately
+      // leaked (not a static object) so vars released by other static
+      // destructors never see it destroyed.
+      static const holder * create_immortal(T&& val) {
+         return new holder(nullptr, true, std::move(val));
+      }
+   };
+
+   // The type table for T.  Its address identifies T, so checking the
+   // type of a held value is usually a single pointer compare.  (The table is
+   // deliberately non-const so the linker can never fold two of them into
+   // one.)  Equal and compare are only called once the caller has checked
+   // both sides hold a T.
+   template <typename T, bool Local = shared_var_detail::is_local<T>::value>
+   struct ops {
+      static const T& value(const void * storage) {
+         return *static_cast<const T *>(storage);
+      }
+
+      static bool equals(const void * lhs, const void * rhs) {
+         return value(lhs) == value(rhs);
+      }
+
+      static std::size_t hash(const void * storage) {
+         return shared_var_detail::hash_value(value(storage));
+      }
+
+      static int compare(const void * lhs, const void * rhs) {
+         return shared_var_detail::compare_value(value(lhs), value(rhs));
+      }
+
+      static void destroy(const void *) {
+      }
+
+      static shared_var_detail::type_desc table;
+   };
+
+   template <typename T>
+   struct ops<T, false> {
+      static const holder<T> * get(const void * storage) {
+         return static_cast<const holder<T> *>(*static_cast<const holder_base * const *>(storage));
+      }
+
+      static bool equals(const void * lhs, const void * rhs) {
+         return get(lhs)->value_ == get(rhs)->value_;
+      }
+
+      static std::size_t hash(const void * storage) {
+         const holder<T> * p = get(storage);
+         std::size_t h = p->hash_.load(std::memory_order_relaxed);
+         if (h == 0) {
+            h = shared_var_detail::hash_value(p->value_);
+            p->hash_.store(h, std::memory_order_relaxed);
+         }
+         return h;
+      }
+
+      static int compare(const void * lhs, const void * rhs) {
+         return shared_var_detail::compare_value(get(lhs)->value_, get(rhs)->value_);
+      }
+
+      static void destroy(const void * storage) {
+         holder<T> * self = const_cast<holder<T> *>(get(storage));
+         std::pmr::memory_resource * mr = self->mr_;
+         self->~holder();
+         shared_var_detail::deallocate(self, sizeof(holder<T>), alignof(holder<T>), mr);
+      }
+
+      static shared_var_detail::type_desc table;
+   };
+
+   // nullptr when empty.
+   const shared_var_detail::type_desc * type_;
+
+   // Which member is live depends on type_->local.
+   union {
+      const holder_base * p_;
+      shared_var_detail::local_storage local_;
+   };
+
+   bool _shared() const {
+      return type_ != nullptr && !type_->local;
+   }
+
+   void _reset() {
+      if (_shared() && p_->release(type_->destroy)) {
+         _dispose();
+      }
+      type_ = nullptr;
+   }
+
+   // Destroys the holder once the last reference is gone, or hands it to
+   // this thread's reclaimer.
+   void _dispose() {
+      if constexpr (RefCount::thread_safe) {
+         shared_var_reclaimer * r = shared_var_detail::current_reclaimer();
+         if (r != nullptr) {
+            r->defer(p_, type_->destroy);
+            return;
+         }
+      }
+      type_->destroy(&local_);
+   }
+
+   void _copy(const basic_shared_var& rhs) {
+      local_ = rhs.local_;
+      type_ = rhs.type_;
+      if (_shared()) {
+         p_->add_ref();
+      }
+   }
+
+   void _move(basic_shared_var& rhs) noexcept {
+      local_ = rhs.local_;
+      type_ = rhs.type_;
+      rhs.type_ = nullptr;
+   }
+
+   template <class T>
+   const T * _value(std::true_type /* local */) const {
+      return reinterpret_cast<const T *>(&local_);
+   }
+
+   template <class T>
+   const T * _value(std::false_type /* local */) const {
+      return &static_cast<const holder<T> *>(p_)->value_;
+   }
+
+   // The held value if it is a T, otherwise nullptr.  Behind get_if,
+   // get, take, mutate and edit, none of which can hand out a view.
+   template <class T>
+   const typename std::decay<T>::type * _get() const {
+      typedef typename std::decay<T>::type value_type;
+      static_assert(!shared_var_detail::is_string_view<value_type>::value,
+         "a shared_var never holds a string view; use as<std::string_view>()");
+      if (_is_type<value_type>()) {
+         return _value<value_type>(shared_var_detail::is_local<value_type>());
+      }
+      return nullptr;
+   }
+
+   // Values common enough to share one immortal holder per process.
+   // Small integers and bools need no entry: they are stored inline.
+   template <class T>
+   static const holder_base * _constant(const T&) {
+      return nullptr;
+   }
+
+   template <class CharT>
+   static const holder_base * _constant(const std::basic_string<CharT>& val) {
+      if (!val.empty()) {
+         return nullptr;
+      }
+      static const holder_base * empty = holder<std::basic_string<CharT>>::create_immortal(std::basic_string<CharT>());
+      return empty;
+   }
+
+   // Replaces the held value with a T constructed from args.  The new
+   // value is built before the old one is released, so args may refer to
+   // it.
+   template <class T, class... Args>
+   void _construct(std::true_type /* local */, Args&&... args) {
+      T val(std::forward<Args>(args)...);
+      _reset();
+      local_ = shared_var_detail::local_storage();
+      new (&local_) T(val);
+      type_ = _type_id<T>();
+   }
+
+   template <class T, class... Args>
+   void _construct(std::false_type /* local */, Args&&... args) {
+      const holder_base * p = nullptr;
+      if constexpr (sizeof...(Args) == 1 &&
+         (std::is_same<typename std::decay<Args>::type, T>::value && ...)) {
+         p = _constant(args...);
+      }
+      if (p == nullptr) {
+         p = holder<T>::create(std::forward<Args>(args)...);
+      }
+      _reset();
+      p_ = p;
+      type_ = _type_id<T>();
+   }
+
+   template <class T, class... Args>
+   void _emplace(Args&&... args) {
+      _construct<T>(typename shared_var_detail::is_local<T>::type(), std::forward<Args>(args)...);
+   }
+
+   // The held T, made this var's alone for writing: a shared holder (or
+   // an immortal one) is cloned first.  Clears the cached hash.
+   template <class T>
+   T * _unshare() {
+      const T * p_value = _get<T>();
+      if (p_value == nullptr) {
+         shared_var_detail::throw_bad_access();
+      }
+      if (!_shared()) {
+         return const_cast<T *>(p_value);
+      }
+      if (!p_->unique()) {
+         const holder_base * p = holder<T>::create(*p_value);
+         _reset();
+         p_ = p;
+         type_ = _type_id<T>();
+      }
+      p_->hash_.store(0, std::memory_order_relaxed);
+      return &const_cast<holder<T> *>(static_cast<const holder<T> *>(p_))->value_;
+   }
+
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   void _hold(T&& val) {
+      _emplace<T>(std::move(val));
+   }
+
+   // A C string or string view, copied straight into the holder's
+   // string.  Short ones fit in the string's own buffer, so they cost
+   // the holder and nothing more; "" costs nothing at all.
+   template <class CharT>
+   void _hold_chars(std::basic_string_view<CharT> chars) {
+      if (chars.empty()) {
+         _hold(std::basic_string<CharT>());
+      }
+      else {
+         _emplace<std::basic_string<CharT>>(chars.data(), chars.size());
+      }
+   }
+
+public:
+   bool _equals(const basic_shared_var& rhs) const {
+      if (!shared_var_detail::same_type(type_, rhs.type_)) {
+         return false;
+      }
+      else if (type_ == nullptr) {
+         return true;
+      }
+      else if (type_->local) {
+         return type_->equals(&local_, &rhs.local_);
+      }
+      else if (p_ == rhs.p_) {
+         return true;
+      }
+      else if (!type_->hash_matches_equals) {
+         return type_->equals(&local_, &rhs.local_);
+      }
+      // Distinct holders interned in one pool hold different values, and
+      // equal values have equal hashes wherever both are cached.  Both
+      // only hold when the hash agrees with ==.
+      const void * pool = p_->interned_.load(std::memory_order_relaxed);
+      if (pool != nullptr && pool == rhs.p_->interned_.load(std::memory_order_relaxed)) {
+         return false;
+      }
+      std::size_t lhs_hash = p_->hash_.load(std::memory_order_relaxed);
+      std::size_t rhs_hash = rhs.p_->hash_.load(std::memory_order_relaxed);
+      if (lhs_hash != 0 && rhs_hash != 0 && lhs_hash != rhs_hash) {
+         return false;
+      }
+      return type_->equals(&local_, &rhs.local_);
+   }
+
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   bool _equals_val(const T& rhs) const {
+      const typename std::decay<T>::type * p_value = _get<T>();
+      if (p_value == nullptr) {
+         return false;
+      }
+      return *p_value == rhs;
+   }
+
+   // Compares a held string with rhs in place: lengths, then characters.
+   template <class CharT>
+   bool _equals_chars(std::basic_string_view<CharT> rhs) const {
+      const std::basic_string<CharT> * p_value = _get<std::basic_string<CharT>>();
+      return p_value != nullptr && std::basic_string_view<CharT>(*p_value) == rhs;
+   }
+
+   const shared_var_detail::type_desc * _type() const {
+      return type_;
+   }
+
+   // The size of a holder for T, for sizing arenas up front.
+   template <class T>
+   static constexpr std::size_t _holder_size() {
+      return sizeof(holder<T>);
+   }
+
+   // True if this var holds the only reference to its holder.
+   bool _unique() const {
+      return _shared() && p_->unique();
+   }
+
+   // The intern pool this var's holder is interned in, or nullptr.
+   const void * _interned() const {
+      return _shared() ? p_->interned_.load(std::memory_order_relaxed) : nullptr;
+   }
+
+   // Moves the holder from one pool's marking to another's, if it still
+   // has the first.  Only for shared_var_intern_pool.
+   void _mark_interned(const void * from, const void * to) const {
+      if (_shared()) {
+         p_->interned_.compare_exchange_strong(from, to, std::memory_order_relaxed);
+      }
+   }
+
+   // The same holder, or the same inline bits: identity, not equality.
+   bool _identical(const basic_shared_var& rhs) const {
+      if (type_ != rhs.type_) {
+         return false;
+      }
+      return type_ == nullptr || (type_->local ?
+         std::memcmp(&local_, &rhs.local_, sizeof(local_)) == 0 : p_ == rhs.p_);
+   }
+
+   template <class T>
+   static const shared_var_detail::type_desc * _type_id() {
+      return &ops<typename std::decay<T>::type>::table;
+   }
+
+   template <class T>
+   bool _is_type() const {
+      return shared_var_detail::is_type<T>(type_, _type_id<T>());
+   }
+
+   // Only valid once the caller has checked the var holds a T.
+   template <class T>
+   const T& _unchecked_as() const {
+      return *_value<T>(shared_var_detail::is_local<T>());
+   }
+public:
+   basic_shared_var()
+      : type_(nullptr), p_(nullptr) {
+   }
+
+   ~basic_shared_var() {
+      _reset();
+   }
+
+   // Other vars
+
+   basic_shared_var(const basic_shared_var& rhs) {
+      _copy(rhs);
+   }
+
+   basic_shared_var(basic_shared_var&& val) noexcept {
+      _move(val);
+   }
+
+   // rhs may live inside the value this var holds (node = node's child),
+   // so take it before letting go of the old value.
+   basic_shared_var& operator=(const basic_shared_var& rhs) {
+      if (this != &rhs) {
+         basic_shared_var keep(rhs);
+         _reset();
+         _move(keep);
+      }
+      return *this;
+   }
+
+   basic_shared_var& operator=(basic_shared_var&& rhs) noexcept {
+      if (this != &rhs) {
+         basic_shared_var keep(std::move(rhs));
+         _reset();
+         _move(keep);
+      }
+      return *this;
+   }
+
+   explicit basic_shared_var(std::nullptr_t)
+      : type_(nullptr), p_(nullptr) {
+
+   }
+
+   basic_shared_var& operator=(std::nullptr_t) {
+      _reset();
+      return *this;
+   }
+
+   // C-string special handling
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   explicit basic_shared_var(const CharT * rhs)
+      : type_(nullptr), p_(nullptr) {
+      _hold_chars(std::basic_string_view<CharT>(rhs));
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   basic_shared_var& operator=(const CharT * rhs) {
+      _hold_chars(std::basic_string_view<CharT>(rhs));
+      return *this;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   explicit basic_shared_var(std::basic_string_view<CharT> rhs)
+      : type_(nullptr), p_(nullptr) {
+      _hold_chars(rhs);
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   basic_shared_var& operator=(std::basic_string_view<CharT> rhs) {
+      _hold_chars(rhs);
+      return *this;
+   }
+
+   // generic "holdable" types:
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   explicit basic_shared_var(const T& val)
+      : type_(nullptr), p_(nullptr) {
+      _emplace<T>(val);
+   }
+
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   explicit basic_shared_var(T&& val)
+      : type_(nullptr), p_(nullptr) {
+      _hold(std::move(val));
+   }   
+
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   basic_shared_var& operator=(const T& rhs) {
+      _emplace<T>(rhs);
+      return *this;
+   }
+
+   template <class T, class U = const typename enable_if_holdable<T>::type>
+   basic_shared_var& operator=(T&& rhs) {
+      _hold(std::move(rhs));
+      return *this;
+   }
+
+   // Moves the held T out and leaves the var empty.  The value is moved
+   // only when this var holds the sole reference to it (or it is stored
+   // inline); otherwise it is copied and the other owners keep theirs.
+   // Throws bad_shared_var_access if the var doesn't hold a T.
+   template <class T>
+   T take() {
+      const T * p_value = _get<T>();
+      if (p_value == nullptr) {
+         shared_var_detail::throw_bad_access();
+      }
+      if (!_shared() || !p_->unique()) {
+         T val(*p_value);
+         _reset();
+         return val;
+      }
+      T val(std::move(*const_cast<T *>(p_value)));
+      type_->destroy(&local_);
+      type_ = nullptr;
+      return val;
+   }
+
+   // Copy on write: calls fn with the held T as a T&, first cloning the
+   // holder if other vars share it, and returns what fn returns.  Throws
+   // bad_shared_var_access if the var doesn't hold a T.
+   template <class T, class F>
+   decltype(auto) mutate(F&& fn) {
+      return std::forward<F>(fn)(*_unshare<T>());
+   }
+
+   // As mutate(), but hands out the reference.  It stays valid until the
+   // var is next assigned or destroyed; copying the var while writing
+   // through it would change the copy too.  Don't hash or compare the var
+   // while writing through the reference: a hash cached in between goes
+   // stale, and later compares may trust it.
+   template <class T>
+   T& edit() {
+      return *_unshare<T>();
+   }
+
+   // Replaces the held value with a T constructed in place from args,
+   // straight into its holder, and returns it.
+   template <class T, class... Args>
+   const T& emplace(Args&&... args) {
+      typedef typename enable_if_holdable<T>::type holdable;
+      _emplace<holdable>(std::forward<Args>(args)...);
+      return _unchecked_as<T>();
+   }
+
+
+
+   // as, is, empty
+   //
+   // Small trivially copyable values live inside the shared_var, so the
+   // reference returned by as() is only valid while this shared_var holds
+   // the value (not merely while some copy of it does).
+   //
+   // A std::basic_string_view stands for the string type it views:
+   // is<std::string_view>() is true when the var holds a std::string, and
+   // as<std::string_view>() returns a view of it (or an empty view).
+   template <class T>
+   typename shared_var_detail::enable_if_not_view<T, const T&>::type as() const {
+      const typename std::decay<T>::type * p_value = _get<T>();
+      if (p_value != nullptr) {
+         return *p_value;
+      }
+      static const T defaultValue = T();
+      return defaultValue;
+   }
+
+   template <class T>
+   typename shared_var_detail::enable_if_not_view<T, const T&>::type as(const T& def) const {
+      const typename std::decay<T>::type * p_value = _get<T>();
+      if (p_value != nullptr) {
+         return *p_value;
+      }
+      return def;
+   }
+
+   template <class T>
+   typename shared_var_detail::enable_if_view<T, T>::type as(T def = T()) const {
+      const auto * p_value = _get<typename shared_var_detail::is_string_view<T>::string_type>();
+      return p_value != nullptr ? T(*p_value) : def;
+   }
+
+   // The held value if it is a T, otherwise nullptr.  Unlike as<T>(), a
+   // miss needs no default T.
+   template <class T>
+   const T * get_if() const {
+      return _get<T>();
+   }
+
+   // The held value; throws bad_shared_var_access if it isn't a T.
+   template <class T>
+   const T& get() const {
+      const T * p_value = _get<T>();
+      if (p_value == nullptr) {
+         shared_var_detail::throw_bad_access();
+      }
+      return *p_value;
+   }
+
+   template <class T>
+   bool is() const {
+
+      if constexpr (std::is_null_pointer<T>::value) {
+         return type_ == nullptr;
+      }
+      else if constexpr (shared_var_detail::is_string_view<T>::value) {
+         return nullptr != _get<typename shared_var_detail::is_string_view<T>::string_type>();
+      }
+      else {
+         return nullptr != _get<T>();
+      }
+   }
+
+   bool empty() const {
+      return type_ == nullptr;
+   }
+
+   // Equal vars hash equal; vars holding different types may collide.
+   std::size_t hash() const {
+      if (type_ == nullptr) {
+         return 0;
+      }
+      return type_->hash(&local_);
+   }
+
+   // Total order: by type rank, then by value within a type.  Returns a
+   // negative number, zero or a positive number like strcmp.
+   int compare(const basic_shared_var& rhs) const {
+      if (shared_var_detail::same_type(type_, rhs.type_)) {
+         if (type_ == nullptr) {
+            return 0;
+         }
+         else if (!type_->local && p_ == rhs.p_) {
+            return 0;
+         }
+         return type_->compare(&local_, &rhs.local_);
+      }
+      return shared_var_detail::compare_types(type_, rhs.type_);
+   }
+};
+
+template <class RefCount>
+template <typename T, bool Local>
+shared_var_detail::type_desc basic_shared_var<RefCount>::ops<T, Local>::table = {
+   shared_var_detail::type_hash<T>::value,
+   shared_var_detail::type_name<T>(),
+   shared_var_type_rank<T>::value,
+   true,
+   std::is_trivially_copyable<T>::value,
+   sizeof(T),
+   shared_var_detail::unique_name(shared_var_detail::type_name<T>()),
+   shared_var_detail::hash_matches_equals<T>::value,
+   &ops::equals,
+   &ops::hash,
+   &ops::compare,
+   &ops::destroy
+};
+
+template <class RefCount>
+template <typename T>
+shared_var_detail::type_desc basic_shared_var<RefCount>::ops<T, false>::table = {
+   shared_var_detail::type_hash<T>::value,
+   shared_var_detail::type_name<T>(),
+   shared_var_type_rank<T>::value,
+   false,
+   std::is_trivially_copyable<T>::value,
+   sizeof(T),
+   shared_var_detail::unique_name(shared_var_detail::type_name<T>()),
+   shared_var_detail::hash_matches_equals<T>::value,
+   &ops::equals,
+   &ops::hash,
+   &ops::compare,
+   &ops::destroy
+};
+
+namespace std {
+   template <class RefCount>
+   struct hash<basic_shared_var<RefCount>> {
+      std::size_t operator()(const basic_shared_var<RefCount>& v) const {
+         return v.hash();
+      }
+   };
+}
+
+// The default: holders may be shared between threads.
+typedef basic_shared_var<atomic_refcount> shared_var;
+
+// A var holding a T constructed in place from args.
+template <class T, class RefCount = atomic_refcount, class... Args>
+basic_shared_var<RefCount> make_var(Args&&... args) {
+   basic_shared_var<RefCount> v;
+   v.template emplace<T>(std::forward<Args>(args)...);
+   return v;
+}
+
+template <class RefCount>
+bool operator==(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs._equals(rhs);
+}
+
+template <class RefCount>
+bool operator!=(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return !lhs._equals(rhs);
+}
+
+// ordering.
+
+template <class RefCount>
+bool operator<(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs.compare(rhs) < 0;
+}
+
+template <class RefCount>
+bool operator>(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs.compare(rhs) > 0;
+}
+
+template <class RefCount>
+bool operator<=(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs.compare(rhs) <= 0;
+}
+
+template <class RefCount>
+bool operator>=(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs.compare(rhs) >= 0;
+}
+
+#if defined(__cpp_impl_three_way_comparison) && __cpp_impl_three_way_comparison >= 201907L
+template <class RefCount>
+std::weak_ordering operator<=>(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) {
+   return lhs.compare(rhs) <=> 0;
+}
+#endif
+
+// Comparator for sorted containers and algorithms.
+struct shared_var_less {
+   template <class RefCount>
+   bool operator()(const basic_shared_var<RefCount>& lhs, const basic_shared_var<RefCount>& rhs) const {
+      return lhs.compare(rhs) < 0;
+   }
+};
+
+
+// compare with anything.
+
+template <class RefCount, class T, class U = const typename enable_if_holdable<T>::type>
+bool operator==(const basic_shared_var<RefCount>& lhs, const T& rhs) {
+   return lhs._equals_val(rhs);
+}
+
+template <class RefCount, class T, class U = const typename enable_if_holdable<T>::type>
+bool operator!=(const basic_shared_var<RefCount>& lhs, const T& rhs) {
+   return !lhs._equals_val(rhs);
+}
+
+
+template <class RefCount, class T, class U = const typename enable_if_holdable<T>::type>
+bool operator==(const T& lhs, const basic_shared_var<RefCount>& rhs) {
+   return rhs._equals_val(lhs);
+}
+
+template <class RefCount, class T, class U = const typename enable_if_holdable<T>::type>
+bool operator!=(const T& lhs, const basic_shared_var<RefCount>& rhs) {
+   return !rhs._equals_val(lhs);
+}
+
+
+// null pointer.
+template <class RefCount>
+bool operator==(std::nullptr_t, const basic_shared_var<RefCount>& rhs) {
+   return rhs.empty();
+}
+
+template <class RefCount>
+bool operator==(const basic_shared_var<RefCount>& lhs, std::nullptr_t) {
+   return lhs.empty();
+}
+
+template <class RefCount>
+bool operator!=(std::nullptr_t, const basic_shared_var<RefCount>& rhs) {
+   return !rhs.empty();
+}
+
+template <class RefCount>
+bool operator!=(const basic_shared_var<RefCount>& lhs, std::nullptr_t) {
+   return !lhs.empty();
+}
+
+// For C-strings and string views; neither builds a std::basic_string.
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator==(const basic_shared_var<RefCount>& lhs, const CharT * rhs) {
+   return lhs._equals_chars(std::basic_string_view<CharT>(rhs));
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator==(const CharT * lhs, const basic_shared_var<RefCount>& rhs) {
+   return rhs._equals_chars(std::basic_string_view<CharT>(lhs));
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator!=(const basic_shared_var<RefCount>& lhs, const CharT * rhs) {
+   return !(operator==(lhs, rhs));
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator!=(const CharT * lhs, const basic_shared_var<RefCount>& rhs) {
+   return !(operator==(rhs, lhs));
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator==(const basic_shared_var<RefCount>& lhs, std::basic_string_view<CharT> rhs) {
+   return lhs._equals_chars(rhs);
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator==(std::basic_string_view<CharT> lhs, const basic_shared_var<RefCount>& rhs) {
+   return rhs._equals_chars(lhs);
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator!=(const basic_shared_var<RefCount>& lhs, std::basic_string_view<CharT> rhs) {
+   return !lhs._equals_chars(rhs);
+}
+
+template <class RefCount, class CharT, class U = typename enable_if_char<CharT>::type>
+bool operator!=(std::basic_string_view<CharT> lhs, const basic_shared_var<RefCount>& rhs) {
+   return !rhs._equals_chars(lhs);
+}
+
+// atomic_shared_var
+//
+// A shared_var cell that many threads may load() from while others
+// store() to it, as std::atomic<std::shared_ptr> allows.  Loads are
+// lock-free: a reader publishes the cell's current box in its thread's
+// hazard pointer, checks the cell still holds it and copies the var out.
+// Writers swap in a new box and retire the old one; retired boxes are
+// freed by a later write once no reader's hazard pointer names them.
+// Writers take a mutex while retiring, so they should be the rare side
+// (configuration snapshots, routing tables and the like).
+
+namespace shared_var_detail {
+
+   struct hazard_record {
+      std::atomic<const void *> ptr{ nullptr };
+      std::atomic<bool> active{ false };
+      hazard_record * next = nullptr;
+   };
+
+   // Hazard pointers for every thread, and the objects retired but not
+   // yet freed.  Records are never unlinked; an exiting thread's record is
+   // reused by the next thread that needs one.  The domain itself is never
+   // destroyed, so cells with static storage (constructed before it, and
+   // so destroyed after it) can still retire into it at exit.
+   class hazard_domain {
+   public:
+      static hazard_domain& instance() {
+         static hazard_domain& domain = *new hazard_domain;
+         return domain;
+      }
+
+      hazard_record * acquire() {
+         for (hazard_record * r = head_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+            bool idle = false;
+            if (r->active.compare_exchange_strong(idle, true, std::memory_order_acq_rel)) {
+               return r;
+            }
+         }
+         hazard_record * r = new hazard_record;
+         r->active.store(true, std::memory_order_relaxed);
+         r->next = head_.load(std::memory_order_relaxed);
+         while (!head_.compare_exchange_weak(r->next, r,
+            std::memory_order_release, std::memory_order_relaxed)) {
+         }
+         return r;
+      }
+
+      void release(hazard_record * r) {
+         r->ptr.store(nullptr, std::memory_order_release);
+         r->active.store(false, std::memory_order_release);
+      }
+
+      // Frees p with destroy once no hazard pointer names it.
+      void retire(const void * p, void (*destroy)(const void *)) {
+         std::vector<retired> ready;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            retired_.push_back(retired{ p, destroy });
+            std::vector<const void *> hazards;
+            for (hazard_record * r = head_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+               const void * h = r->ptr.load(std::memory_order_seq_cst);
+               if (h != nullptr) {
+                  hazards.push_back(h);
+               }
+            }
+            std::size_t kept = 0;
+            for (const retired& item : retired_) {
+               if (std::find(hazards.begin(), hazards.end(), item.p) != hazards.end()) {
+                  retired_[kept++] = item;
+               }
+               else {
+                  ready.push_back(item);
+               }
+            }
+            retired_.resize(kept);
+         }
+         // Outside the lock: freeing a box can run arbitrary destructors.
+         for (const retired& item : ready) {
+            item.destroy(item.p);
+         }
+      }
+
+   private:
+      struct retired {
+         const void * p;
+         void (*destroy)(const void *);
+      };
+
+      hazard_domain()
+         : head_(nullptr) {
+      }
+
+      std::atomic<hazard_record *> head_;
+      std::mutex mutex_;
+      std::vector<retired> retired_;
+   };
+
+   // The calling thread's hazard pointer.
+   inline std::atomic<const void *>& thread_hazard() {
+      struct slot {
+         hazard_record * r;
+
+         slot()
+            : r(hazard_domain::instance().acquire()) {
+         }
+
+         ~slot() {
+            hazard_domain::instance().release(r);
+         }
+      };
+      static thread_local slot s;
+      return s.r->ptr;
+   }
+}
+
+class atomic_shared_var {
+public:
+   atomic_shared_var() noexcept
+      : box_(nullptr) {
+   }
+
+   explicit atomic_shared_var(shared_var v)
+      : box_(_box(std::move(v))) {
+   }
+
+   atomic_shared_var(const atomic_shared_var&) = delete;
+   atomic_shared_var& operator=(const atomic_shared_var&) = delete;
+
+   ~atomic_shared_var() {
+      _retire(box_.load(std::memory_order_relaxed));
+   }
+
+   shared_var load() const {
+      std::atomic<const void *>& hazard = shared_var_detail::thread_hazard();
+      const box * b = _protect(hazard);
+      shared_var v = b == nullptr ? shared_var() : b->value;
+      hazard.store(nullptr, std::memory_order_release);
+      return v;
+   }
+
+   void store(shared_var v) {
+      _retire(box_.exchange(_box(std::move(v)), std::memory_order_seq_cst));
+   }
+
+   shared_var exchange(shared_var v) {
+      const box * old = box_.exchange(_box(std::move(v)), std::memory_order_seq_cst);
+      shared_var previous = old == nullptr ? shared_var() : old->value;
+      _retire(old);
+      return previous;
+   }
+
+   // Stores desired if the cell holds the very value expected does (the
+   // same holder, or the same inline value); otherwise loads the current
+   // value into expected.  Like std::atomic<std::shared_ptr>, this is
+   // identity, not operator==.
+   bool compare_exchange(shared_var& expected, shared_var desired) {
+      std::atomic<const void *>& hazard = shared_var_detail::thread_hazard();
+      const box * next = _box(std::move(desired));
+      for (;;) {
+         const box * b = _protect(hazard);
+         if (b == nullptr ? !expected.empty() : !b->value._identical(expected)) {
+            expected = b == nullptr ? shared_var() : b->value;
+            hazard.store(nullptr, std::memory_order_release);
+            if (next != nullptr) {
+               _destroy(next);
+            }
+            return false;
+         }
+         if (box_.compare_exchange_strong(b, next, std::memory_order_seq_cst)) {
+            hazard.store(nullptr, std::memory_order_release);
+            _retire(b);
+            return true;
+         }
+      }
+   }
+
+private:
+   struct box {
+      shared_var value;
+   };
+
+   // Empty vars are stored as a null box, so they cost no allocation.
+   static const box * _box(shared_var v) {
+      return v.empty() ? nullptr : new box{ std::move(v) };
+   }
+
+   static void _destroy(const void * p) {
+      delete static_cast<const box *>(p);
+   }
+
+   static void _retire(const box * b) {
+      if (b != nullptr) {
+         shared_var_detail::hazard_domain::instance().retire(b, &_destroy);
+      }
+   }
+
+   // Loads the current box and publishes it in hazard, retrying until the
+   // cell still holds it; it can't be freed until hazard is cleared.  The
+   // publish, the re-check, the writers' swaps of box_ and retire()'s scan
+   // are all seq_cst: either the writer's scan sees the hazard or the
+   // re-check sees the new box.
+   const box * _protect(std::atomic<const void *>& hazard) const {
+      const box * b = box_.load(std::memory_order_acquire);
+      for (;;) {
+         hazard.store(b, std::memory_order_seq_cst);
+         const box * again = box_.load(std::memory_order_seq_cst);
+         if (again == b) {
+            return b;
+         }
+         b = again;
+      }
+   }
+
+   std::atomic<const box *> box_;
+};
+
+// Interns values: equal values passed to intern() come back sharing one
+// holder, so a document full of repeated strings keeps one copy of each,
+// and == on two vars interned in the same pool is a pointer compare.
+// Values are keyed by type and hash.  The pool keeps a reference to each
+// value until clear() or purge().  Values stored inline have no holder to
+// share and come back as they are.  Thread-safe.
+//
+//    shared_var_intern_pool pool;
+//    record["status"] = pool.intern(shared_var("ok"));
+//
+class shared_var_intern_pool {
+public:
+   shared_var_intern_pool() = default;
+   shared_var_intern_pool(const shared_var_intern_pool&) = delete;
+   shared_var_intern_pool& operator=(const shared_var_intern_pool&) = delete;
+
+   ~shared_var_intern_pool() {
+      clear();
+   }
+
+   // The pool's var equal to v, adding v if there is none.
+   shared_var intern(shared_var v) {
+      if (v.empty() || v._type()->local) {
+         return v;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = values_.find(v);
+      if (it == values_.end()) {
+         it = values_.insert(std::move(v)).first;
+         it->_mark_interned(nullptr, this);
+      }
+      return *it;
+   }
+
+   std::size_t size() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return values_.size();
+   }
+
+   // Drops every value; vars already interned keep theirs.
+   void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const shared_var& v : values_) {
+         v._mark_interned(this, nullptr);
+      }
+      values_.clear();
+   }
+
+   // Drops the values no var outside the pool still holds, and returns
+   // how many went.
+   std::size_t purge() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::size_t dropped = 0;
+      for (auto it = values_.begin(); it != values_.end();) {
+         if (it->_unique()) {
+            it = values_.erase(it);
+            ++dropped;
+         }
+         else {
+            ++it;
+         }
+      }
+      return dropped;
+   }
+
+private:
+   struct key_hash {
+      std::size_t operator()(const shared_var& v) const {
+         std::size_t seed = static_cast<std::size_t>(v._type()->id);
+         shared_var_detail::hash_combine(seed, v.hash());
+         return seed;
+      }
+   };
+
+   mutable std::mutex mutex_;
+   std::unordered_set<shared_var, key_hash> values_;
+};
+
+// visit.
+//
+//    visit(visitor, var)
+//    visit<T1, T2, ...>(visitor, var)
+//    visit(visitor, lhs, rhs)
+//
+// Calls the visitor with the held value as a const T&, or with nullptr
+// when the var is empty.  The first form dispatches over the built-in
+// registered types (bool, the character, integer and floating point types,
+// std::string, std::wstring, std::vector<shared_var> and
+// std::map<std::string, shared_var>); the second over exactly T1, T2, ....
+// Anything else, and any value the visitor has no overload for, is passed
+// as the var itself, so every visitor needs a catch-all taking
+// const shared_var& (a generic lambda will do).  Ordinary overload
+// resolution applies, implicit conversions included, as with std::visit.
+//
+// Dispatch is one indirect call through a table indexed by the type's
+// rank, however many types are listed; only listed unregistered types
+// fall back to comparing types one by one.  The two-var form dispatches on
+// each var in turn.
+
+namespace shared_var_detail {
+
+   template <class... Ts>
+   struct type_list {};
+
+   template <class RefCount>
+   using builtin_types = type_list<
+      bool, char, signed char, unsigned char, wchar_t,
+      short, unsigned short, int, unsigned int, long, unsigned long,
+      long long, unsigned long long, float, double, long double,
+      std::string, std::wstring,
+      std::vector<basic_shared_var<RefCount>>,
+      std::map<std::string, basic_shared_var<RefCount>>>;
+
+   template <typename T>
+   struct is_registered : std::integral_constant<bool,
+      shared_var_type_rank<T>::value != shared_var_unregistered_rank> {};
+
+   template <class Result, class Visitor, class Var>
+   Result visit_var(Visitor& vis, const Var& v) {
+      return static_cast<Result>(vis(v));
+   }
+
+   template <class Result, class Visitor, class Var>
+   Result visit_empty(Visitor& vis, const Var& v) {
+      if constexpr (std::is_invocable<Visitor&, std::nullptr_t>::value) {
+         return static_cast<Result>(vis(nullptr));
+      }
+      else {
+         return static_cast<Result>(vis(v));
+      }
+   }
+
+   template <class Result, class Visitor, class Var, class T>
+   Result visit_as(Visitor& vis, const Var& v) {
+      if constexpr (std::is_invocable<Visitor&, const T&>::value) {
+         if (v.template _is_type<T>()) {
+            return static_cast<Result>(vis(v.template _unchecked_as<T>()));
+         }
+      }
+      return static_cast<Result>(vis(v));
+   }
+
+   // Listed types without a rank: compare types one by one.
+   template <class Result, class Visitor, class Var>
+   Result visit_unregistered(Visitor& vis, const Var& v, type_list<>) {
+      return static_cast<Result>(vis(v));
+   }
+
+   template <class Result, class Visitor, class Var, class T, class... Ts>
+   Result visit_unregistered(Visitor& vis, const Var& v, type_list<T, Ts...>) {
+      if constexpr (!is_registered<T>::value) {
+         if (v.template _is_type<T>()) {
+            return visit_as<Result, Visitor, Var, T>(vis, v);
+         }
+      }
+      return visit_unregistered<Result>(vis, v, type_list<Ts...>());
+   }
+
+   template <class Result, class Visitor, class Var, class List>
+   struct visit_table;
+
+   template <class Result, class Visitor, class Var, class... Ts>
+   struct visit_table<Result, Visitor, Var, type_list<Ts...>> {
+      typedef Result (*thunk)(Visitor&, const Var&);
+
+      static constexpr int max_rank() {
+         int m = 0;
+         ((m = is_registered<Ts>::value && shared_var_type_rank<Ts>::value > m ?
+            shared_var_type_rank<Ts>::value : m), ...);
+         return m;
+      }
+
+      static constexpr std::size_t size = max_rank() + 1;
+
+      static Result other(Visitor& vis, const Var& v) {
+         return visit_unregistered<Result>(vis, v, type_list<Ts...>());
+      }
+
+      template <class T>
+      static constexpr void add(std::array<thunk, size>& table) {
+         if constexpr (is_registered<T>::value) {
+            table[shared_var_type_rank<T>::value] = &visit_as<Result, Visitor, Var, T>;
+         }
+      }
+
+      static constexpr std::array<thunk, size> make() {
+         std::array<thunk, size> table{};
+         for (std::size_t i = 0; i < size; ++i) {
+            table[i] = &other;
+         }
+         table[0] = &visit_empty<Result, Visitor, Var>;
+         (add<Ts>(table), ...);
+         return table;
+      }
+
+      static constexpr std::array<thunk, size> table = make();
+
+      static Result dispatch(Visitor& vis, const Var& v) {
+         const type_desc * type = v._type();
+         std::size_t rank = type == nullptr ? 0 : static_cast<std::size_t>(type->rank);
+         if (rank < size) {
+            return table[rank](vis, v);
+         }
+         return other(vis, v);
+      }
+   };
+
+   template <class RefCount, class... Ts>
+   using visit_types = typename std::conditional<sizeof...(Ts) == 0,
+      builtin_types<RefCount>, type_list<Ts...>>::type;
+}
+
+template <class... Ts, class Visitor, class RefCount>
+decltype(auto) visit(Visitor&& vis, const basic_shared_var<RefCount>& v) {
+   typedef basic_shared_var<RefCount> var;
+   static_assert(std::is_invocable<Visitor&, const var&>::value,
+      "visitor needs a catch-all taking const shared_var&");
+   typedef std::invoke_result_t<Visitor&, const var&> result;
+   return shared_var_detail::visit_table<result, typename std::remove_reference<Visitor>::type,
+      var, shared_var_detail::visit_types<RefCount, Ts...>>::dispatch(vis, v);
+}
+
+template <class... Ts, class Visitor, class RefCount>
+decltype(auto) visit(Visitor&& vis, const basic_shared_var<RefCount>& lhs,
+   const basic_shared_var<RefCount>& rhs) {
+   typedef basic_shared_var<RefCount> var;
+   static_assert(std::is_invocable<Visitor&, const var&, const var&>::value,
+      "visitor needs a catch-all taking (const shared_var&, const shared_var&)");
+   typedef std::invoke_result_t<Visitor&, const var&, const var&> result;
+   return visit<Ts...>([&](const auto& x) -> result {
+      return visit<Ts...>([&](const auto& y) -> result {
+         if constexpr (std::is_invocable<Visitor&, decltype(x), decltype(y)>::value) {
+            return vis(x, y);
+         }
+         else {
+            return vis(lhs, rhs);
+         }
+      }, rhs);
+   }, lhs);
+}
+
+// Binary encoding.
+//
+//    std::size_t size = shared_var_encode(doc, nullptr, 0);
+//    std::vector<unsigned char> bytes(size);
+//    shared_var_encode(doc, bytes.data(), bytes.size());
+//    shared_var copy = shared_var_decode(bytes.data(), bytes.size());
+//
+// Encodes the built-in registered types (see visit): empty vars, bool,
+// the character, integer and floating point types except long double,
+// std::string, std::wstring, and vectors and string-keyed maps of vars,
+// nested to any depth.  Each value is its type's rank as a one-byte tag,
+// followed by:
+//
+//    bool, char types     one byte
+//    integers             a varint (zigzag for signed types)
+//    wchar_t              a varint of the code unit's bits, unsigned, so
+//                         characters encode alike whether wchar_t is
+//                         signed or not
+//    float, double        the IEEE bits, little-endian
+//    std::string          a varint length, then the bytes
+//    std::wstring         a varint length, then each code unit as a varint
+//    vector               a varint count, then the values
+//    map                  a varint count, then each key as a std::string
+//                         without its tag, followed by its value
+//
+// so an encoding reads the same on any platform that can represent its
+// values.  Decoding gives every value back its original type.
+//
+// shared_var_encode() writes into the caller's buffer and nothing else,
+// and returns the size of the whole encoding; if that is more than size,
+// the buffer holds only a prefix of it.  shared_var_decode() reads the
+// input twice: once to check it and measure the document, then to build
+// it, taking every holder from one block allocated up front.  That block
+// is freed once the last of them goes.  Strings and containers still
+// allocate their own buffers.  Both throw bad_shared_var_format: encoding
+// a type outside the list above, or decoding input that is truncated,
+// has trailing bytes, holds a value out of range for its type, or nests
+// deeper than shared_var_max_decode_depth.
+
+const int shared_var_max_decode_depth = 512;
+
+namespace shared_var_detail {
+
+   [[noreturn]] inline void throw_bad_format() {
+      throw bad_shared_var_format();
+   }
+
+   // Appends to the caller's buffer, counting bytes that don't fit.
+   struct encode_sink {
+      unsigned char * out;
+      std::size_t size;
+      std::size_t pos;
+
+      void byte(unsigned char b) {
+         if (pos < size) {
+            out[pos] = b;
+         }
+         ++pos;
+      }
+
+      void varint(std::uint64_t v) {
+         while (v >= 0x80) {
+            byte(static_cast<unsigned char>(v | 0x80));
+            v >>= 7;
+         }
+         byte(static_cast<unsigned char>(v));
+      }
+
+      void fixed(std::uint64_t bits, int bytes) {
+         for (int i = 0; i < bytes; ++i) {
+            byte(static_cast<unsigned char>(bits >> (8 * i)));
+         }
+      }
+
+      void chars(const std::string& s) {
+         varint(s.size());
+         if (pos <= size && s.size() <= size - pos) {
+            std::memcpy(out + pos, s.data(), s.size());
+         }
+         pos += s.size();
+      }
+   };
+
+   template <class RefCount>
+   struct encode_visitor {
+      typedef basic_shared_var<RefCount> var;
+
+      encode_sink& sink;
+
+      template <typename T>
+      void integer(T val) {
+         if constexpr (std::is_same<T, wchar_t>::value) {
+            sink.varint(static_cast<std::make_unsigned<wchar_t>::type>(val));
+         }
+         else if constexpr (std::is_signed<T>::value) {
+            std::int64_t v = val;
+            sink.varint((static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63));
+         }
+         else {
+            sink.varint(val);
+         }
+      }
+
+      template <typename T>
+      void operator()(const T& val) {
+         if constexpr (std::is_same<T, std::nullptr_t>::value) {
+            sink.byte(0);
+         }
+         else if constexpr (is_shared_var<T>::value || std::is_same<T, long double>::value) {
+            throw_bad_format();
+         }
+         else {
+            sink.byte(static_cast<unsigned char>(shared_var_type_rank<T>::value));
+            if constexpr (std::is_same<T, bool>::value) {
+               sink.byte(val ? 1 : 0);
+            }
+            else if constexpr (sizeof(T) == 1) {
+               sink.byte(static_cast<unsigned char>(val));
+            }
+            else if constexpr (std::is_integral<T>::value) {
+               integer(val);
+            }
+            else if constexpr (std::is_same<T, float>::value) {
+               std::uint32_t bits;
+               std::memcpy(&bits, &val, sizeof(bits));
+               sink.fixed(bits, 4);
+            }
+            else if constexpr (std::is_same<T, double>::value) {
+               std::uint64_t bits;
+               std::memcpy(&bits, &val, sizeof(bits));
+               sink.fixed(bits, 8);
+            }
+            else if constexpr (std::is_same<T, std::string>::value) {
+               sink.chars(val);
+            }
+            else if constexpr (std::is_same<T, std::wstring>::value) {
+               sink.varint(val.size());
+               for (wchar_t c : val) {
+                  integer(c);
+               }
+            }
+            else if constexpr (std::is_same<T, std::vector<var>>::value) {
+               sink.varint(val.size());
+               for (const var& element : val) {
+                  visit(*this, element);
+               }
+            }
+            else {
+               sink.varint(val.size());
+               for (const auto& entry : val) {
+                  sink.chars(entry.first);
+                  visit(*this, entry.second);
+               }
+            }
+         }
+      }
+   };
+
+   // Memory for the holders of one decoded document: a single block,
+   // sized up front, that frees itself once the decoder and every holder
+   // allocated from it have let go.  Holders may let go on any thread.
+   // Should the block run short, the rest come from operator new.
+   class document_arena : public std::pmr::memory_resource {
+   public:
+      static document_arena * create(std::size_t capacity) {
+         void * mem = ::operator new(sizeof(document_arena) + capacity);
+         return new (mem) document_arena(capacity);
+      }
+
+      // Drops the decoder's reference.
+      void release() {
+         _unref();
+      }
+
+   protected:
+      void * do_allocate(std::size_t bytes, std::size_t align) override {
+         std::uintptr_t base = reinterpret_cast<std::uintptr_t>(this + 1);
+         std::uintptr_t p = (base + used_ + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+         void * mem;
+         if (p + bytes > base + capacity_) {
+            mem = std::pmr::new_delete_resource()->allocate(bytes, align);
+         }
+         else {
+            used_ = p + bytes - base;
+            mem = reinterpret_cast<void *>(p);
+         }
+         live_.fetch_add(1, std::memory_order_relaxed);
+         return mem;
+      }
+
+      void do_deallocate(void * p, std::size_t bytes, std::size_t align) override {
+         const char * base = reinterpret_cast<const char *>(this + 1);
+         if (std::less<const char *>()(static_cast<const char *>(p), base) ||
+            !std::less<const char *>()(static_cast<const char *>(p), base + capacity_)) {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+         }
+         _unref();
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+         return this == &other;
+      }
+
+   private:
+      explicit document_arena(std::size_t capacity)
+         : capacity_(capacity), used_(0), live_(1) {
+      }
+
+      void _unref() {
+         if (live_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~document_arena();
+            ::operator delete(static_cast<void *>(this));
+         }
+      }
+
+      const std::size_t capacity_;
+      std::size_t used_;
+      std::atomic<std::size_t> live_;
+   };
+
+   struct decode_source {
+      const unsigned char * p;
+      const unsigned char * end;
+
+      unsigned char byte() {
+         if (p == end) {
+            throw_bad_format();
+         }
+         return *p++;
+      }
+
+      std::uint64_t varint() {
+         std::uint64_t v = 0;
+         for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b = byte();
+            v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+               return v;
+            }
+         }
+         throw_bad_format();
+      }
+
+      std::uint64_t fixed(int bytes) {
+         std::uint64_t bits = 0;
+         for (int i = 0; i < bytes; ++i) {
+            bits |= static_cast<std::uint64_t>(byte()) << (8 * i);
+         }
+         return bits;
+      }
+
+      // A count of things each at least a byte long, so never more than
+      // what is left.
+      std::size_t count() {
+         std::uint64_t n = varint();
+         if (n > static_cast<std::uint64_t>(end - p)) {
+            throw_bad_format();
+         }
+         return static_cast<std::size_t>(n);
+      }
+
+      const char * skip(std::size_t n) {
+         const char * chars = reinterpret_cast<const char *>(p);
+         p += n;
+         return chars;
+      }
+   };
+
+   // Parses one document.  The measuring pass (Build false) only checks
+   // the input and adds up the holders it would need.
+   template <class RefCount, bool Build>
+   struct decoder {
+      typedef basic_shared_var<RefCount> var;
+
+      decode_source in;
+      std::size_t holder_bytes;
+
+      template <typename T>
+      void hold(var& v, T val) {
+         if constexpr (Build) {
+            v.template emplace<T>(std::move(val));
+         }
+         else if constexpr (!is_local<T>::value) {
+            const std::size_t align = alignof(std::max_align_t);
+            holder_bytes += (var::template _holder_size<T>() + align - 1) / align * align;
+         }
+      }
+
+      template <typename T>
+      T integer() {
+         std::uint64_t v = in.varint();
+         if constexpr (std::is_same<T, wchar_t>::value) {
+            typedef std::make_unsigned<wchar_t>::type bits;
+            if (v > std::numeric_limits<bits>::max()) {
+               throw_bad_format();
+            }
+            return static_cast<T>(static_cast<bits>(v));
+         }
+         else if constexpr (std::is_signed<T>::value) {
+            std::int64_t s = static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1);
+            if (s < std::numeric_limits<T>::min() || s > std::numeric_limits<T>::max()) {
+               throw_bad_format();
+            }
+            return static_cast<T>(s);
+         }
+         else {
+            if (v > std::numeric_limits<T>::max()) {
+               throw_bad_format();
+            }
+            return static_cast<T>(v);
+         }
+      }
+
+      std::string chars() {
+         std::size_t n = in.count();
+         const char * p = in.skip(n);
+         return Build ? std::string(p, n) : std::string();
+      }
+
+      template <typename T>
+      void scalar(var& v) {
+         if constexpr (std::is_same<T, bool>::value) {
+            unsigned char b = in.byte();
+            if (b > 1) {
+               throw_bad_format();
+            }
+            hold(v, b == 1);
+         }
+         else if constexpr (sizeof(T) == 1) {
+            hold(v, static_cast<T>(in.byte()));
+         }
+         else if constexpr (std::is_integral<T>::value) {
+            hold(v, integer<T>());
+         }
+         else {
+            typedef typename std::conditional<sizeof(T) == 4, std::uint32_t, std::uint64_t>::type bits_type;
+            bits_type bits = static_cast<bits_type>(in.fixed(sizeof(T)));
+            T val;
+            std::memcpy(&val, &bits, sizeof(val));
+            hold(v, val);
+         }
+      }
+
+      var value(int depth) {
+         if (depth > shared_var_max_decode_depth) {
+            throw_bad_format();
+         }
+         var v;
+         switch (in.byte()) {
+         case 0: break;
+         case shared_var_type_rank<bool>::value: scalar<bool>(v); break;
+         case shared_var_type_rank<char>::value: scalar<char>(v); break;
+         case shared_var_type_rank<signed char>::value: scalar<signed char>(v); break;
+         case shared_var_type_rank<unsigned char>::value: scalar<unsigned char>(v); break;
+         case shared_var_type_rank<wchar_t>::value: scalar<wchar_t>(v); break;
+         case shared_var_type_rank<short>::value: scalar<short>(v); break;
+         case shared_var_type_rank<unsigned short>::value: scalar<unsigned short>(v); break;
+         case shared_var_type_rank<int>::value: scalar<int>(v); break;
+         case shared_var_type_rank<unsigned int>::value: scalar<unsigned int>(v); break;
+         case shared_var_type_rank<long>::value: scalar<long>(v); break;
+         case shared_var_type_rank<unsigned long>::value: scalar<unsigned long>(v); break;
+         case shared_var_type_rank<long long>::value: scalar<long long>(v); break;
+         case shared_var_type_rank<unsigned long long>::value: scalar<unsigned long long>(v); break;
+         case shared_var_type_rank<float>::value: scalar<float>(v); break;
+         case shared_var_type_rank<double>::value: scalar<double>(v); break;
+         case shared_var_type_rank<std::string>::value:
+            hold(v, chars());
+            break;
+         case shared_var_type_rank<std::wstring>::value: {
+            std::size_t n = in.count();
+            std::wstring s;
+            if (Build) {
+               s.reserve(n);
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+               wchar_t c = integer<wchar_t>();
+               if (Build) {
+                  s.push_back(c);
+               }
+            }
+            hold(v, std::move(s));
+            break;
+         }
+         case shared_var_type_rank<std::vector<var>>::value: {
+            std::size_t n = in.count();
+            std::vector<var> items;
+            if (Build) {
+               items.reserve(n);
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+               var item = value(depth + 1);
+               if (Build) {
+                  items.push_back(std::move(item));
+               }
+            }
+            hold(v, std::move(items));
+            break;
+         }
+         case shared_var_type_rank<std::map<std::string, var>>::value: {
+            std::size_t n = in.count();
+            std::map<std::string, var> items;
+            for (std::size_t i = 0; i < n; ++i) {
+               std::string key = chars();
+               var item = value(depth + 1);
+               if (Build) {
+                  items.emplace_hint(items.end(), std::move(key), std::move(item));
+               }
+            }
+            hold(v, std::move(items));
+            break;
+         }
+         default:
+            throw_bad_format();
+         }
+         return v;
+      }
+
+      var document() {
+         var v = value(0);
+         if (in.p != in.end) {
+            throw_bad_format();
+         }
+         return v;
+      }
+   };
+}
+
+// Writes v's encoding to buffer, as much as fits in size bytes, and
+// returns the size of the whole encoding.
+template <class RefCount>
+std::size_t shared_var_encode(const basic_shared_var<RefCount>& v, void * buffer, std::size_t size) {
+   shared_var_detail::encode_sink sink{ static_cast<unsigned char *>(buffer), size, 0 };
+   shared_var_detail::encode_visitor<RefCount> encode{ sink };
+   visit(encode, v);
+   return sink.pos;
+}
+
+// The document encoded in data.
+template <class RefCount = atomic_refcount>
+basic_shared_var<RefCount> shared_var_decode(const void * data, std::size_t size) {
+   const unsigned char * begin = static_cast<const unsigned char *>(data);
+   shared_var_detail::decoder<RefCount, false> measure{ { begin, begin + size }, 0 };
+   measure.document();
+
+   struct releaser {
+      shared_var_detail::document_arena * arena;
+
+      ~releaser() {
+         arena->release();
+      }
+   } arena{ shared_var_detail::document_arena::create(measure.holder_bytes + alignof(std::max_align_t)) };
+   shared_var_resource_scope scope(arena.arena);
+   shared_var_detail::decoder<RefCount, true> build{ { begin, begin + size }, 0 };
+   return build.document();
+}
+
+// shared_var_of<T1, T2, ...>
+//
+// A shared_var restricted to a fixed list of types, for hot paths where
+// the whole set is known up front.  Same is/as/get/== interface as
+// shared_var, but holding or asking for an unlisted type does not
+// compile.  The held type is an index into the list, so type checks are
+// an integer compare and visit() is a switch over the list.  Values are
+// stored and shared as in shared_var: small trivially copyable ones
+// inline, the rest in one counted, immutable holder that copies share.
+
+namespace shared_var_detail {
+
+   // 1-based position of T in Ts, 0 when T isn't listed.
+   template <class T, class... Ts>
+   struct index_of : std::integral_constant<std::size_t, 0> {};
+
+   template <class T, class U, class... Ts>
+   struct index_of<T, U, Ts...> : std::integral_constant<std::size_t,
+      std::is_same<T, U>::value ? 1 :
+      index_of<T, Ts...>::value == 0 ? 0 : index_of<T, Ts...>::value + 1> {};
+
+   template <class T, class... Ts>
+   struct type_count : std::integral_constant<std::size_t,
+      (std::size_t(0) + ... + std::size_t(std::is_same<T, Ts>::value))> {};
+
+   // Shares one immutable T between copies, like a shared_var holder.
+   template <class T>
+   class counted_ptr {
+   public:
+      explicit counted_ptr(T&& val) {
+         std::pmr::memory_resource * mr = current_resource();
+         void * mem = allocate(sizeof(block), alignof(block), mr);
+         try {
+            p_ = new (mem) block(std::move(val), mr);
+         }
+         catch (...) {
+            deallocate(mem, sizeof(block), alignof(block), mr);
+            throw;
+         }
+      }
+
+      counted_ptr(const counted_ptr& rhs)
+         : p_(rhs.p_) {
+         p_->refs_.add_ref();
+      }
+
+      counted_ptr(counted_ptr&& rhs) noexcept
+         : p_(rhs.p_) {
+         rhs.p_ = nullptr;
+      }
+
+      ~counted_ptr() {
+         _release();
+      }
+
+      counted_ptr& operator=(counted_ptr rhs) noexcept {
+         std::swap(p_, rhs.p_);
+         return *this;
+      }
+
+      const T& get() const {
+         return p_->value_;
+      }
+
+      friend bool operator==(const counted_ptr& lhs, const counted_ptr& rhs) {
+         return lhs.p_ == rhs.p_ || lhs.get() == rhs.get();
+      }
+
+   private:
+      struct block {
+         block(T&& val, std::pmr::memory_resource * mr)
+            : mr_(mr), value_(std::move(val)) {
+         }
+
+         mutable atomic_refcount::count refs_;
+         std::pmr::memory_resource * const mr_;
+         T value_;
+      };
+
+      void _release() {
+         if (p_ != nullptr && p_->refs_.release()) {
+            block * self = const_cast<block *>(p_);
+            std::pmr::memory_resource * mr = self->mr_;
+            self->~block();
+            deallocate(self, sizeof(block), alignof(block), mr);
+         }
+      }
+
+      const block * p_;
+   };
+
+   template <class T>
+   using closed_slot = typename std::conditional<is_local<T>::value, T, counted_ptr<T>>::type;
+
+   inline std::nullptr_t unslot(std::monostate) {
+      return nullptr;
+   }
+
+   template <class T>
+   const T& unslot(const T& value) {
+      return value;
+   }
+
+   template <class T>
+   const T& unslot(const counted_ptr<T>& p) {
+      return p.get();
+   }
+}
+
+template <class... Ts>
+class shared_var_of {
+   static_assert(sizeof...(Ts) > 0, "shared_var_of needs at least one type");
+   static_assert(((shared_var_detail::type_count<Ts, Ts...>::value == 1) && ...),
+      "shared_var_of types must be distinct");
+   static_assert(((std::is_same<Ts, typename std::decay<Ts>::type>::value) && ...),
+      "shared_var_of types must be plain value types");
+
+   template <class T>
+   using index_of = shared_var_detail::index_of<typename std::decay<T>::type, Ts...>;
+
+   template <class T>
+   using enable_if_listed = std::enable_if<index_of<T>::value != 0>;
+
+   template <class T>
+   static constexpr std::size_t _index() {
+      static_assert(index_of<T>::value != 0, "type is not listed in this shared_var_of");
+      return index_of<T>::value;
+   }
+
+   std::variant<std::monostate, shared_var_detail::closed_slot<Ts>...> v_;
+
+public:
+   typedef std::variant<std::monostate, shared_var_detail::closed_slot<Ts>...> variant_type;
+
+   const variant_type& _variant() const {
+      return v_;
+   }
+
+   shared_var_of() {
+   }
+
+   shared_var_of(const shared_var_of&) = default;
+
+   // Leaves rhs empty rather than holding a moved-from value.
+   shared_var_of(shared_var_of&& rhs) noexcept
+      : v_(std::move(rhs.v_)) {
+      rhs.v_.template emplace<0>();
+   }
+
+   shared_var_of& operator=(const shared_var_of&) = default;
+
+   shared_var_of& operator=(shared_var_of&& rhs) noexcept {
+      if (this != &rhs) {
+         v_ = std::move(rhs.v_);
+         rhs.v_.template emplace<0>();
+      }
+      return *this;
+   }
+
+   explicit shared_var_of(std::nullptr_t) {
+   }
+
+   shared_var_of& operator=(std::nullptr_t) {
+      v_.template emplace<0>();
+      return *this;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   explicit shared_var_of(const CharT * rhs) {
+      _hold(std::basic_string<CharT>(rhs));
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   shared_var_of& operator=(const CharT * rhs) {
+      _hold(std::basic_string<CharT>(rhs));
+      return *this;
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   explicit shared_var_of(T&& val) {
+      _hold(typename std::decay<T>::type(std::forward<T>(val)));
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   shared_var_of& operator=(T&& rhs) {
+      _hold(typename std::decay<T>::type(std::forward<T>(rhs)));
+      return *this;
+   }
+
+   template <class T>
+   const T& as() const {
+      const T * p_value = _get<T>();
+      if (p_value != nullptr) {
+         return *p_value;
+      }
+      static const T defaultValue = T();
+      return defaultValue;
+   }
+
+   template <class T>
+   const T& as(const T& def) const {
+      const T * p_value = _get<T>();
+      return p_value != nullptr ? *p_value : def;
+   }
+
+   template <class T>
+   const T * get_if() const {
+      return _get<T>();
+   }
+
+   template <class T>
+   const T& get() const {
+      const T * p_value = _get<T>();
+      if (p_value == nullptr) {
+         shared_var_detail::throw_bad_access();
+      }
+      return *p_value;
+   }
+
+   template <class T>
+   bool is() const {
+      if constexpr (std::is_null_pointer<T>::value) {
+         return v_.index() == 0;
+      }
+      else {
+         return v_.index() == _index<T>();
+      }
+   }
+
+   bool empty() const {
+      return v_.index() == 0;
+   }
+
+   friend bool operator==(const shared_var_of& lhs, const shared_var_of& rhs) {
+      return lhs.v_ == rhs.v_;
+   }
+
+   friend bool operator!=(const shared_var_of& lhs, const shared_var_of& rhs) {
+      return !(lhs.v_ == rhs.v_);
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   friend bool operator==(const shared_var_of& lhs, const T& rhs) {
+      const T * p_value = lhs.template _get<T>();
+      return p_value != nullptr && *p_value == rhs;
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   friend bool operator==(const T& lhs, const shared_var_of& rhs) {
+      return rhs == lhs;
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   friend bool operator!=(const shared_var_of& lhs, const T& rhs) {
+      return !(lhs == rhs);
+   }
+
+   template <class T, class U = typename enable_if_listed<T>::type>
+   friend bool operator!=(const T& lhs, const shared_var_of& rhs) {
+      return !(rhs == lhs);
+   }
+
+   friend bool operator==(const shared_var_of& lhs, std::nullptr_t) {
+      return lhs.empty();
+   }
+
+   friend bool operator!=(const shared_var_of& lhs, std::nullptr_t) {
+      return !lhs.empty();
+   }
+
+   friend bool operator==(std::nullptr_t, const shared_var_of& rhs) {
+      return rhs.empty();
+   }
+
+   friend bool operator!=(std::nullptr_t, const shared_var_of& rhs) {
+      return !rhs.empty();
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator==(const shared_var_of& lhs, const CharT * rhs) {
+      const std::basic_string<CharT> * p_value = lhs.template _get<std::basic_string<CharT>>();
+      return p_value != nullptr && *p_value == rhs;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator==(const CharT * lhs, const shared_var_of& rhs) {
+      return rhs == lhs;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator!=(const shared_var_of& lhs, const CharT * rhs) {
+      return !(lhs == rhs);
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator!=(const CharT * lhs, const shared_var_of& rhs) {
+      return !(rhs == lhs);
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator==(const shared_var_of& lhs, std::basic_string_view<CharT> rhs) {
+      const std::basic_string<CharT> * p_value = lhs.template _get<std::basic_string<CharT>>();
+      return p_value != nullptr && std::basic_string_view<CharT>(*p_value) == rhs;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator!=(const shared_var_of& lhs, std::basic_string_view<CharT> rhs) {
+      return !(lhs == rhs);
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator==(std::basic_string_view<CharT> lhs, const shared_var_of& rhs) {
+      return rhs == lhs;
+   }
+
+   template <class CharT, class U = typename enable_if_char<CharT>::type>
+   friend bool operator!=(std::basic_string_view<CharT> lhs, const shared_var_of& rhs) {
+      return !(rhs == lhs);
+   }
+
+private:
+   template <class T>
+   const T * _get() const {
+      constexpr std::size_t index = _index<T>();
+      if (v_.index() != index) {
+         return nullptr;
+      }
+      return &shared_var_detail::unslot(*std::get_if<index>(&v_));
+   }
+
+   template <class T>
+   void _hold(T&& val) {
+      constexpr std::size_t index = _index<T>();
+      if constexpr (shared_var_detail::is_local<T>::value) {
+         v_.template emplace<index>(std::move(val));
+      }
+      else {
+         v_.template emplace<index>(shared_var_detail::counted_ptr<T>(std::move(val)));
+      }
+   }
+};
+
+// Calls the visitor with the held value as a const T&, or with nullptr
+// when the var is empty, so it needs an overload for every listed type.
+template <class Visitor, class... Ts>
+decltype(auto) visit(Visitor&& vis, const shared_var_of<Ts...>& v) {
+   return std::visit([&](const auto& slot) -> decltype(auto) {
+      return vis(shared_var_detail::unslot(slot));
+   }, v._variant());
 }
 
 #endif // _SHARED_VAR_H_INCLUDED_
@@ -1,6 +1,17 @@
 #pragma once
 
+#ifdef _MSC_VER
+
 #include "targetver.h"
 
 // Headers for CppUnitTest
 #include "CppUnitTest.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+#else
+
+// Portable stand-in for CppUnitTest
+#include "unit_test.h"
+
+#endif
@@ -0,0 +1,20 @@
+#include "unit_test.h"
+
+#include <cstdio>
+#include <exception>
+
+int main() {
+   int failed = 0;
+   for (const unit_test::test_case& test : unit_test::registry()) {
+      try {
+         test.run();
+         std::printf("[ ok ] %s\n", test.name);
+      }
+      catch (const std::exception& e) {
+         ++failed;
+         std::printf("[FAIL] %s: %s\n", test.name, e.what());
+      }
+   }
+   std::printf("%d of %d tests failed\n", failed, static_cast<int>(unit_test::registry().size()));
+   return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// A small portable stand-in for the Microsoft CppUnitTest framework, so the
+// same test sources build with GCC and Clang.  Supports the subset the
+// tests use: TEST_CLASS, TEST_METHOD, Assert::IsTrue and Assert::IsFalse.
+// Link with unit_test.cpp, which provides main().
+
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+namespace unit_test {
+
+   class failure : public std::runtime_error {
+   public:
+      explicit failure(const char * what)
+         : std::runtime_error(what) {
+      }
+   };
+
+   struct Assert {
+      static void IsTrue(bool condition) {
+         if (!condition) {
+            throw failure("Assert::IsTrue failed");
+         }
+      }
+
+      static void IsFalse(bool condition) {
+         if (condition) {
+            throw failure("Assert::IsFalse failed");
+         }
+      }
+   };
+
+   struct test_case {
+      const char * name;
+      std::function<void()> run;
+   };
+
+   inline std::vector<test_case>& registry() {
+      static std::vector<test_case> tests;
+      return tests;
+   }
+
+   struct registrar {
+      registrar(const char * name, std::function<void()> run) {
+         registry().push_back(test_case{ name, run });
+      }
+   };
+}
+
+using unit_test::Assert;
+
+#define TEST_CLASS(name) struct name
+
+// The registrar's constructor body is compiled once the class is complete,
+// so it can name the test method declared after it.
+#define TEST_METHOD(name) \
+   struct name##_registrar { \
+      name##_registrar() { \
+         ::unit_test::registrar(#name, &name); \
+      } \
+   }; \
+   static inline name##_registrar name##_registered; \
+   static void name()
@@ -1,12 +1,138 @@
 #include "stdafx.h"
-#include "CppUnitTest.h"
 #include "shared_var.h"
 #include <string>
 #include <vector>
+#include <limits>
 #include <list>
 #include <map>
+#include <algorithm>
+#include <cctype>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
 
-using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+struct Point {
+   short x, y;
+};
+
+bool operator==(const Point& lhs, const Point& rhs) {
+   return lhs.x == rhs.x && lhs.y == rhs.y;
+}
+
+// Counts live instances, to check holders are freed exactly once.
+struct Tracked {
+   static int live;
+   int id;
+
+   explicit Tracked(int i) : id(i) { ++live; }
+   Tracked(const Tracked& rhs) : id(rhs.id) { ++live; }
+   ~Tracked() { --live; }
+};
+
+int Tracked::live = 0;
+
+// A cell with static storage, as a process-wide configuration would be.
+// It is constructed before anything touches the hazard pointers and
+// destroyed after them.
+atomic_shared_var global_config(shared_var("boot"));
+
+namespace {
+   // Private to this file, so another file may have its own Unexported.
+   struct Unexported {
+      long long a;
+      long long b;
+
+      bool operator==(const Unexported& rhs) const { return a == rhs.a && b == rhs.b; }
+   };
+}
+
+// Counts copies and moves, to check values are built in place.
+struct Copies {
+   static int copies;
+   static int moves;
+
+   Copies() {}
+   Copies(const Copies&) { ++copies; }
+   Copies(Copies&&) { ++moves; }
+   bool operator==(const Copies&) const { return true; }
+};
+
+int Copies::copies = 0;
+int Copies::moves = 0;
+
+// Counts operator== calls, to check equality short-circuits.  Too big to
+// be stored inline.
+struct Compared {
+   static int compares;
+   long long id;
+   long long more;
+
+   bool operator==(const Compared& rhs) const { ++compares; return id == rhs.id; }
+};
+
+int Compared::compares = 0;
+
+namespace std {
+   template <>
+   struct hash<Compared> {
+      std::size_t operator()(const Compared& c) const { return std::hash<long long>()(c.id); }
+   };
+}
+
+// A range of characters whose == ignores case.
+struct Folded {
+   std::string text;
+
+   std::string::const_iterator begin() const { return text.begin(); }
+   std::string::const_iterator end() const { return text.end(); }
+
+   bool operator==(const Folded& rhs) const {
+      return text.size() == rhs.text.size() && std::equal(text.begin(), text.end(), rhs.text.begin(),
+         [](char x, char y) { return std::tolower(x) == std::tolower(y); });
+   }
+};
+
+struct Describe {
+   std::string operator()(int i) const { return "int " + std::to_string(i); }
+   std::string operator()(double) const { return "double"; }
+   std::string operator()(const std::string& s) const { return "string " + s; }
+   std::string operator()(std::nullptr_t) const { return "empty"; }
+   std::string operator()(const shared_var&) const { return "other"; }
+};
+
+struct Add {
+   shared_var operator()(int lhs, int rhs) const { return shared_var(lhs + rhs); }
+   shared_var operator()(double lhs, double rhs) const { return shared_var(lhs + rhs); }
+   shared_var operator()(const shared_var&, const shared_var&) const { return shared_var(); }
+};
+
+// Counts bytes handed out, to check where holders are allocated from.
+class CountingResource : public std::pmr::memory_resource {
+public:
+   std::size_t allocations = 0;
+   std::size_t outstanding = 0;
+
+protected:
+   void * do_allocate(std::size_t bytes, std::size_t align) override {
+      ++allocations;
+      outstanding += bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes, align);
+   }
+
+   void do_deallocate(void * p, std::size_t bytes, std::size_t align) override {
+      outstanding -= bytes;
+      std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+   }
+
+   bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+   }
+};
+
+bool operator==(const Tracked& lhs, const Tracked& rhs) {
+   return lhs.id == rhs.id;
+}
 
 namespace shared_vartest
 {		
@@ -104,6 +230,210 @@ namespace shared_vartest
          Assert::IsTrue(y == 14);
       }
 
+      TEST_METHOD(EmplaceInPlace) {
+         shared_var v = make_var<std::vector<int>>(1000, 7);
+         Assert::IsTrue(v.as<std::vector<int>>().size() == 1000);
+         Assert::IsTrue(v.emplace<std::string>(3, 'x') == "xxx");
+         Assert::IsTrue(v.emplace<std::string>(v.as<std::string>(), 1) == "xx");
+
+         shared_var i = make_var<int>(5);
+         Assert::IsTrue(i.emplace<double>(i.as<int>()) == 5.0 && i.is<double>());
+
+         Copies c;
+         shared_var a(c);
+         a = c;
+         a.emplace<Copies>();
+         Assert::IsTrue(Copies::copies == 2 && Copies::moves == 0);
+
+         CountingResource resource;
+         {
+            shared_var_resource_scope scope(&resource);
+            const std::string empty;
+            shared_var e(empty);
+            e = empty;
+            Assert::IsTrue(resource.allocations == 0);
+         }
+
+         basic_shared_var<local_refcount> local = make_var<std::string, local_refcount>("text");
+         Assert::IsTrue(local == "text");
+      }
+
+      TEST_METHOD(EqualityShortCircuits) {
+         shared_var a(Compared{ 1, 0 });
+         shared_var copy = a;
+         Assert::IsTrue(a == copy && Compared::compares == 0);
+
+         // Different types, or different cached hashes: no compare either.
+         shared_var b(Compared{ 2, 0 });
+         Assert::IsTrue(a != shared_var(std::string("x")) && Compared::compares == 0);
+         a.hash();
+         b.hash();
+         Assert::IsTrue(a != b && Compared::compares == 0);
+
+         // Same hash, separate holders: compared by value.
+         shared_var same(Compared{ 1, 0 });
+         same.hash();
+         Assert::IsTrue(a == same && Compared::compares == 1);
+         Assert::IsTrue(b != shared_var(Compared{ 1, 0 }) && Compared::compares == 2);
+
+         // Only hashes known to agree with == are trusted.
+         using shared_var_detail::hash_matches_equals;
+         Assert::IsTrue(hash_matches_equals<int>::value && hash_matches_equals<Compared>::value);
+         Assert::IsTrue(hash_matches_equals<std::vector<std::pair<int, std::string>>>::value);
+         Assert::IsTrue(hash_matches_equals<std::map<std::string, std::vector<double>>>::value);
+         Assert::IsTrue(!hash_matches_equals<Tracked>::value);
+         Assert::IsTrue(!hash_matches_equals<std::vector<Tracked>>::value);
+
+         // A range whose == ignores case can't be hashed character by
+         // character: equal values still hash equal, cached or not.
+         Assert::IsTrue(!hash_matches_equals<Folded>::value);
+         shared_var upper(Folded{ "ABC" });
+         shared_var lower(Folded{ "abc" });
+         Assert::IsTrue(upper == lower);
+         Assert::IsTrue(upper.hash() == lower.hash());
+         Assert::IsTrue(upper == lower && !(upper != lower));
+         Assert::IsTrue(std::unordered_set<shared_var>{ upper }.count(lower) == 1);
+
+         // Nor in a container of vars, which trusts the vars' hashes.
+         shared_var upper_list(std::vector<shared_var>{ upper });
+         shared_var lower_list(std::vector<shared_var>{ lower });
+         Assert::IsTrue(upper_list == lower_list);
+         upper_list.hash();
+         lower_list.hash();
+         Assert::IsTrue(upper_list == lower_list && !(upper_list != lower_list));
+      }
+
+      TEST_METHOD(StringViewLookups) {
+         const std::string long_text(100, 'x');
+         shared_var v(long_text);
+         shared_var w(L"wide");
+         std::string_view view(long_text);
+
+         Assert::IsTrue(v == view && view == v && !(v != view));
+         Assert::IsTrue(v != view.substr(1) && v != std::string_view());
+         Assert::IsTrue(v == long_text.c_str() && long_text.c_str() == v);
+         Assert::IsTrue(w == std::wstring_view(L"wide") && w != std::string_view("wide"));
+         Assert::IsTrue(shared_var(5) != view && shared_var() != std::string_view());
+
+         Assert::IsTrue(v.is<std::string_view>() && !v.is<std::wstring_view>());
+         Assert::IsTrue(w.is<std::wstring_view>() && !shared_var(5).is<std::string_view>());
+         Assert::IsTrue(v.as<std::string_view>().data() == v.as<std::string>().data());
+         Assert::IsTrue(shared_var(5).as<std::string_view>().empty());
+         Assert::IsTrue(shared_var(5).as(std::string_view("none")) == "none");
+
+         shared_var_of<std::string, int> closed(long_text);
+         Assert::IsTrue(closed == view && closed != std::string_view("x"));
+         Assert::IsTrue(view == closed && std::string_view("x") != closed);
+         Assert::IsTrue(!(std::string_view("x") == closed) && !(view != closed));
+
+         // A view is copied into a string, never held.
+         shared_var held(view);
+         Assert::IsTrue(held.is<std::string>() && held.is<std::string_view>());
+         Assert::IsTrue(held == v && held == view && held.get_if<std::string>() != nullptr);
+         Assert::IsTrue(held.as<std::string_view>() == view);
+         Assert::IsTrue(held.as<std::string_view>().data() != long_text.data());
+         held = std::wstring_view(L"wide");
+         Assert::IsTrue(held == w && held.is<std::wstring>());
+         held = std::string_view();
+         Assert::IsTrue(held == std::string() && held.is<std::string_view>());
+         Assert::IsTrue(!std::is_constructible<shared_var, std::u16string_view>::value);
+      }
+
+      TEST_METHOD(CStringsBuildInPlace) {
+         CountingResource resource;
+         {
+            shared_var_resource_scope scope(&resource);
+            shared_var narrow("hello");
+            shared_var wide(L"wide");
+            Assert::IsTrue(resource.allocations == 2);
+            Assert::IsTrue(narrow == "hello" && wide == L"wide");
+
+            narrow = "";
+            wide = L"";
+            Assert::IsTrue(resource.allocations == 2 && resource.outstanding == 0);
+            Assert::IsTrue(narrow == std::string() && wide.is<std::wstring>());
+         }
+      }
+
+      TEST_METHOD(TakeMovesWhenUnique) {
+         Copies::copies = Copies::moves = 0;
+         shared_var a{ Copies() };
+         shared_var b = a;
+         Copies taken = a.take<Copies>();
+         Assert::IsTrue(a.empty() && b.is<Copies>());
+         Assert::IsTrue(Copies::copies == 1);
+
+         int moves = Copies::moves;
+         Copies last = b.take<Copies>();
+         Assert::IsTrue(b.empty());
+         Assert::IsTrue(Copies::copies == 1 && Copies::moves > moves);
+         Assert::IsTrue(taken == last);
+
+         shared_var s(std::string(100, 'x'));
+         const char * data = s.as<std::string>().data();
+         std::string text = s.take<std::string>();
+         Assert::IsTrue(text.data() == data && s.empty());
+
+         shared_var i(3), e("");
+         Assert::IsTrue(i.take<int>() == 3 && i.empty());
+         Assert::IsTrue(e.take<std::string>().empty() && e.empty());
+         Assert::IsTrue(shared_var("") == "");
+
+         {
+            shared_var t(Tracked(1));
+            Tracked moved = t.take<Tracked>();
+            Assert::IsTrue(Tracked::live == 1);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(MutateCopiesOnWrite) {
+         shared_var a(std::vector<int>{ 1, 2 });
+         shared_var b = a;
+         std::size_t before = a.hash();
+         std::size_t size = a.mutate<std::vector<int>>([](std::vector<int>& v) {
+            v.push_back(3);
+            return v.size();
+         });
+         Assert::IsTrue(size == 3 && b.as<std::vector<int>>().size() == 2);
+         Assert::IsTrue(a.hash() != before);
+         Assert::IsTrue(a.hash() == shared_var(std::vector<int>{ 1, 2, 3 }).hash());
+
+         // Unshared now, so written in place.
+         const std::vector<int> * held = a.get_if<std::vector<int>>();
+         a.edit<std::vector<int>>().push_back(4);
+         Assert::IsTrue(a.get_if<std::vector<int>>() == held && held->size() == 4);
+
+         shared_var i(3), e("");
+         i.edit<int>() += 2;
+         Assert::IsTrue(i == 5);
+         e.edit<std::string>() = "written";
+         Assert::IsTrue(e == "written" && shared_var("") == "");
+      }
+
+      TEST_METHOD(GetIfAndGet) {
+         shared_var x(14), s("text"), e;
+         Assert::IsTrue(x.get_if<int>() != nullptr && *x.get_if<int>() == 14);
+         Assert::IsTrue(x.get_if<double>() == nullptr);
+         Assert::IsTrue(e.get_if<int>() == nullptr);
+         Assert::IsTrue(s.get_if<std::string>() == &s.as<std::string>());
+         Assert::IsTrue(shared_var(Tracked(1)).get_if<Tracked>()->id == 1);
+         Assert::IsTrue(s.get<std::string>() == "text");
+
+         bool thrown = false;
+         try {
+            x.get<std::string>();
+         }
+         catch (const bad_shared_var_access&) {
+            thrown = true;
+         }
+         Assert::IsTrue(thrown);
+
+         shared_var_of<int, std::string> c(14);
+         Assert::IsTrue(c.get_if<int>() != nullptr && c.get<int>() == 14);
+         Assert::IsTrue(c.get_if<std::string>() == nullptr);
+      }
+
       TEST_METHOD(Pair) {
 
          std::pair<shared_var, shared_var> values = std::make_pair(shared_var(4), shared_var("Hello"));
@@ -142,5 +472,758 @@ namespace shared_vartest
          Assert::IsTrue(obj["y"] == "Hello");
          Assert::IsTrue(obj["z"].is<std::vector<bool>>());
       }      
+
+      TEST_METHOD(TypeChecksAreExact) {
+         shared_var v(7);
+
+         Assert::IsTrue(v.is<int>());
+         Assert::IsTrue(v.is<const int&>());
+         Assert::IsFalse(v.is<long>());
+         Assert::IsFalse(v.is<unsigned int>());
+         Assert::IsTrue(v.as<long>(42L) == 42L);
+         Assert::IsFalse(v == 7L);
+         Assert::IsFalse(v == shared_var(7u));
+         Assert::IsTrue(v == shared_var(7));
+      }
+
+      TEST_METHOD(InlineScalars) {
+         shared_var i(5);
+         shared_var b(true);
+         shared_var ll(1LL << 40);
+         shared_var p(Point{ 1, 2 });
+
+         shared_var copy = i;
+         i = 6;
+         Assert::IsTrue(copy == 5);
+         Assert::IsTrue(i == 6);
+
+         shared_var moved(std::move(copy));
+         Assert::IsTrue(moved == 5);
+         Assert::IsTrue(copy.empty());
+
+         Assert::IsTrue(b == true);
+         Assert::IsTrue(ll.as<long long>() == (1LL << 40));
+         Assert::IsTrue(p.is<Point>());
+         Assert::IsTrue(p == (Point{ 1, 2 }));
+         Assert::IsTrue(p == shared_var(Point{ 1, 2 }));
+         Assert::IsFalse(p == shared_var(Point{ 2, 1 }));
+      }
+
+      TEST_METHOD(InlineAndSharedReassign) {
+         shared_var v(1.5);
+         v = std::string("long enough to need a holder of its own");
+         Assert::IsTrue(v.is<std::string>());
+         v = 2;
+         Assert::IsTrue(v == 2);
+         shared_var s("text");
+         s = v;
+         Assert::IsTrue(s == 2);
+         v = s;
+         v = v;
+         Assert::IsTrue(v == 2);
+      }
+
+      TEST_METHOD(VarIsTwoWords) {
+         Assert::IsTrue(sizeof(shared_var) == 16);
+      }
+
+      TEST_METHOD(TypeTable) {
+         shared_var i(7), s("text"), t(Tracked(2));
+         Assert::IsTrue(i._type() == shared_var(8)._type());
+         Assert::IsTrue(i._type()->local && i._type()->trivially_copyable);
+         Assert::IsTrue(!s._type()->local && s._type()->size == sizeof(std::string));
+         Assert::IsTrue(t._type()->rank == shared_var_unregistered_rank);
+      }
+
+      TEST_METHOD(TypeIdentityAcrossModules) {
+         shared_var i(7), l(7L), t(Tracked(2));
+         Assert::IsTrue(i._type()->name == "int");
+         Assert::IsTrue(i._type()->id != l._type()->id);
+
+         // A second module's table for the same type is a different object
+         // with the same name: the same type only when cross-module
+         // matching is turned on.
+         shared_var_detail::type_desc other = *t._type();
+#if defined(SHARED_VAR_CROSS_MODULE_TYPES)
+         const bool cross_module = true;
+#else
+         const bool cross_module = false;
+#endif
+         Assert::IsTrue(shared_var_detail::same_type(&other, t._type()) == cross_module);
+         Assert::IsTrue(shared_var_detail::is_type<Tracked>(&other, t._type()) == cross_module);
+         Assert::IsTrue(!shared_var_detail::same_type(&other, i._type()));
+         Assert::IsTrue(!shared_var_detail::is_type<int>(&other, i._type()));
+
+         // Names from an anonymous namespace never match another table:
+         // another translation unit can have its own type of that name.
+         shared_var hidden(Unexported{ 1, 2 });
+         shared_var_detail::type_desc hidden_other = *hidden._type();
+         Assert::IsTrue(!hidden._type()->unique_name && t._type()->unique_name);
+         Assert::IsTrue(!shared_var_detail::same_type(&hidden_other, hidden._type()));
+         Assert::IsTrue(!shared_var_detail::is_type<Unexported>(&hidden_other, hidden._type()));
+         Assert::IsTrue(hidden.is<Unexported>());
+
+         // Two such types still order one way round: by table.
+         int forward = shared_var_detail::compare_types(&hidden_other, hidden._type());
+         int backward = shared_var_detail::compare_types(hidden._type(), &hidden_other);
+         Assert::IsTrue(forward != 0 && forward == -backward);
+         Assert::IsTrue(shared_var_detail::compare_types(nullptr, hidden._type()) < 0);
+      }
+
+      TEST_METHOD(HolderFreedWithLastReference) {
+         {
+            shared_var a(Tracked(1));
+            Assert::IsTrue(Tracked::live == 1);
+
+            std::vector<shared_var> copies(10, a);
+            shared_var moved(std::move(copies[0]));
+            Assert::IsTrue(Tracked::live == 1);
+            Assert::IsTrue(moved == a);
+
+            a = nullptr;
+            copies.clear();
+            Assert::IsTrue(Tracked::live == 1);
+            Assert::IsTrue(moved == Tracked(1));
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(ResourceScope) {
+         CountingResource resource;
+         shared_var outside;
+         {
+            shared_var_resource_scope scope(&resource);
+            shared_var s(std::string("allocated from the scoped resource"));
+            shared_var i(3);
+            Assert::IsTrue(resource.allocations == 1);
+
+            outside = s;
+         }
+         shared_var after(std::string("allocated from operator new again"));
+         Assert::IsTrue(resource.allocations == 1);
+         Assert::IsTrue(resource.outstanding > 0);
+
+         outside = nullptr;
+         Assert::IsTrue(resource.outstanding == 0);
+      }
+
+      TEST_METHOD(PoolDocument) {
+         CountingResource upstream;
+         {
+            shared_var_pool pool(&upstream);
+            std::map<std::string, shared_var> obj;
+            {
+               shared_var_resource_scope scope(&pool);
+               for (int i = 0; i < 1000; ++i) {
+                  obj[std::to_string(i)] = Tracked(i);
+               }
+               obj["s"] = "Hello";
+            }
+            Assert::IsTrue(upstream.allocations < 10);
+            Assert::IsTrue(obj["500"] == Tracked(500));
+            Assert::IsTrue(obj["s"] == "Hello");
+
+            obj.clear();
+            Assert::IsTrue(Tracked::live == 0);
+
+            // Freed holders are reused before the pool grows again.
+            std::size_t allocations = upstream.allocations;
+            shared_var_resource_scope scope(&pool);
+            std::vector<shared_var> again;
+            for (int i = 0; i < 1000; ++i) {
+               again.push_back(shared_var(Tracked(i)));
+            }
+            Assert::IsTrue(upstream.allocations == allocations);
+            again.clear();
+         }
+         Assert::IsTrue(upstream.outstanding == 0);
+      }
+
+      TEST_METHOD(EmptyStringsShareOneHolder) {
+         CountingResource resource;
+         {
+            shared_var_resource_scope scope(&resource);
+            std::vector<shared_var> blanks;
+            for (int i = 0; i < 100; ++i) {
+               blanks.push_back(shared_var(""));
+               blanks.push_back(shared_var(std::wstring()));
+            }
+            blanks.push_back(shared_var(0));
+            blanks.push_back(shared_var(false));
+            Assert::IsTrue(resource.allocations == 0);
+
+            Assert::IsTrue(blanks[0] == "");
+            Assert::IsTrue(blanks[0].as<std::string>().empty());
+            Assert::IsTrue(blanks[1] == std::wstring());
+            Assert::IsTrue(blanks[0] != blanks[1]);
+
+            shared_var s("");
+            s = "no longer empty";
+            Assert::IsTrue(resource.allocations == 1);
+         }
+         Assert::IsTrue(resource.outstanding == 0);
+         Assert::IsTrue(shared_var("") == std::string());
+      }
+
+      TEST_METHOD(HashEqualValues) {
+         std::hash<shared_var> h;
+
+         Assert::IsTrue(h(shared_var(3)) == h(shared_var(3)));
+         Assert::IsTrue(h(shared_var("status")) == h(shared_var(std::string("status"))));
+         Assert::IsTrue(h(shared_var()) == h(shared_var(nullptr)));
+
+         std::vector<shared_var> list{ shared_var(1), shared_var("two") };
+         Assert::IsTrue(h(shared_var(list)) == h(shared_var(list)));
+
+         std::map<std::string, shared_var> obj;
+         obj["x"] = 4;
+         shared_var doc(obj);
+         shared_var copy = doc;
+         Assert::IsTrue(h(doc) == h(copy));
+         Assert::IsTrue(h(doc) == h(shared_var(obj)));
+
+         // Types without std::hash still hash consistently.
+         Assert::IsTrue(h(shared_var(Point{ 1, 2 })) == h(shared_var(Point{ 1, 2 })));
+
+         // Equal unordered containers, listing their elements in different
+         // orders, still hash alike.
+         std::unordered_set<int> up, down;
+         down.rehash(1024);
+         for (int i = 0; i < 100; ++i) {
+            up.insert(i);
+            down.insert(99 - i);
+         }
+         Assert::IsTrue(up == down && !std::equal(up.begin(), up.end(), down.begin()));
+         Assert::IsTrue(h(shared_var(up)) == h(shared_var(down)));
+      }
+
+      TEST_METHOD(UnorderedMapOfVars) {
+         std::unordered_map<shared_var, int> counts;
+
+         const char * words[] = { "a", "b", "a", "c", "a", "b" };
+         for (const char * w : words) {
+            ++counts[shared_var(w)];
+         }
+         ++counts[shared_var(1)];
+         ++counts[shared_var(1.0)];
+         ++counts[shared_var()];
+
+         Assert::IsTrue(counts.size() == 6);
+         Assert::IsTrue(counts[shared_var("a")] == 3);
+         Assert::IsTrue(counts[shared_var("b")] == 2);
+         Assert::IsTrue(counts[shared_var(1)] == 1);
+         Assert::IsTrue(counts[shared_var()] == 1);
+
+         std::unordered_set<shared_var> unique;
+         for (const char * w : words) {
+            unique.insert(shared_var(w));
+         }
+         Assert::IsTrue(unique.size() == 3);
+      }
+
+      TEST_METHOD(OrderWithinType) {
+         Assert::IsTrue(shared_var(1) < shared_var(2));
+         Assert::IsTrue(shared_var(2.5) > shared_var(-1.0));
+         Assert::IsTrue(shared_var("apple") < shared_var("banana"));
+         Assert::IsTrue(shared_var(3) <= shared_var(3));
+         Assert::IsTrue(shared_var(3) >= shared_var(3));
+         Assert::IsFalse(shared_var(3) < shared_var(3));
+
+         std::vector<shared_var> a{ shared_var(1), shared_var("x") };
+         std::vector<shared_var> b{ shared_var(1), shared_var("y") };
+         Assert::IsTrue(shared_var(a) < shared_var(b));
+
+         // No operator< on Point: all Points are equivalent.
+         Assert::IsTrue(shared_var(Point{ 1, 2 }).compare(shared_var(Point{ 3, 4 })) == 0);
+
+         // NaNs order after every number, and equivalent to each other.
+         const double nan = std::numeric_limits<double>::quiet_NaN();
+         Assert::IsTrue(shared_var(1e300) < shared_var(nan) && !(shared_var(nan) < shared_var(1.0)));
+         Assert::IsTrue(shared_var(nan).compare(shared_var(nan)) == 0);
+         Assert::IsTrue(shared_var(std::vector<double>{ 1.0, 5.0 }) < shared_var(std::vector<double>{ 1.0, nan }));
+         Assert::IsTrue(shared_var(std::make_pair(nan, 1)) > shared_var(std::make_pair(2.0, 1)));
+
+         std::vector<shared_var> values;
+         for (int i = 0; i < 100; ++i) {
+            values.emplace_back(i % 3 == 0 ? nan : double(50 - i));
+         }
+         std::sort(values.begin(), values.end());
+         Assert::IsTrue(std::is_sorted(values.begin(), values.end()));
+         Assert::IsTrue(values[65].as<double>() == 49.0 && values[66].as<double>() != values[66].as<double>());
+      }
+
+      TEST_METHOD(OrderAcrossTypes) {
+         // Empty first, then by registered rank.
+         Assert::IsTrue(shared_var() < shared_var(false));
+         Assert::IsTrue(shared_var(true) < shared_var(0));
+         Assert::IsTrue(shared_var(100) < shared_var(0.5));
+         Assert::IsTrue(shared_var(1e9) < shared_var(""));
+         Assert::IsTrue(shared_var("z") < shared_var(L"a"));
+         Assert::IsTrue(shared_var(L"z") < shared_var(Point{ 0, 0 }));
+
+         // Unregistered types still get a consistent order.
+         shared_var p(Point{ 0, 0 });
+         shared_var t(std::make_pair(1, 2));
+         Assert::IsTrue((p < t) != (t < p));
+      }
+
+      TEST_METHOD(SortAndMapMixed) {
+         std::vector<shared_var> values{
+            shared_var("b"), shared_var(2), shared_var(), shared_var(1.5),
+            shared_var(1), shared_var("a"), shared_var(true)
+         };
+         std::sort(values.begin(), values.end());
+
+         Assert::IsTrue(values[0].empty());
+         Assert::IsTrue(values[1] == true);
+         Assert::IsTrue(values[2] == 1);
+         Assert::IsTrue(values[3] == 2);
+         Assert::IsTrue(values[4] == 1.5);
+         Assert::IsTrue(values[5] == "a");
+         Assert::IsTrue(values[6] == "b");
+
+         std::map<shared_var, int, shared_var_less> index;
+         for (size_t i = 0; i < values.size(); ++i) {
+            index[values[i]] = static_cast<int>(i);
+         }
+         Assert::IsTrue(index[shared_var("a")] == 5);
+         Assert::IsTrue(index.begin()->first.empty());
+      }
+
+      TEST_METHOD(VisitOverloads) {
+         Describe d;
+         Assert::IsTrue(visit(d, shared_var(3)) == "int 3");
+         Assert::IsTrue(visit(d, shared_var(3.5)) == "double");
+         Assert::IsTrue(visit(d, shared_var("x")) == "string x");
+         Assert::IsTrue(visit(d, shared_var()) == "empty");
+         Assert::IsTrue(visit(d, shared_var(Point{ 1, 2 })) == "other");
+         Assert::IsTrue(visit(d, shared_var(L"w")) == "other");
+      }
+
+      TEST_METHOD(VisitListedTypes) {
+         int points = 0, ints = 0, others = 0;
+         auto count = [&](const auto& value) {
+            typedef typename std::decay<decltype(value)>::type T;
+            if constexpr (std::is_same<T, Point>::value) ++points;
+            else if constexpr (std::is_same<T, int>::value) ++ints;
+            else ++others;
+         };
+
+         std::vector<shared_var> values{
+            shared_var(Point{ 1, 2 }), shared_var(1), shared_var(2),
+            shared_var("s"), shared_var(), shared_var(Point{ 3, 4 })
+         };
+         for (const shared_var& v : values) {
+            visit<Point, int>(count, v);
+         }
+         Assert::IsTrue(points == 2);
+         Assert::IsTrue(ints == 2);
+         Assert::IsTrue(others == 2);
+      }
+
+      TEST_METHOD(VisitTwoVars) {
+         Add add;
+         Assert::IsTrue(visit(add, shared_var(2), shared_var(3)) == 5);
+         Assert::IsTrue(visit(add, shared_var(2.5), shared_var(0.5)) == 3.0);
+         Assert::IsTrue(visit(add, shared_var("a"), shared_var(3)).empty());
+         Assert::IsTrue(visit(add, shared_var(), shared_var()).empty());
+      }
+
+      TEST_METHOD(ClosedSetVar) {
+         typedef shared_var_of<int, double, std::string> message_var;
+         message_var i(3), s("text"), e;
+         Assert::IsTrue(sizeof(message_var) == 16);
+         Assert::IsTrue(i.is<int>() && !i.is<double>() && e.is<std::nullptr_t>());
+         Assert::IsTrue(i == 3 && i != 4 && s == "text" && s != i);
+         Assert::IsTrue(s.as<std::string>() == "text" && i.as<double>(1.5) == 1.5);
+         Assert::IsTrue(visit(Describe(), i) == "int 3");
+         Assert::IsTrue(visit(Describe(), s) == "string text");
+         Assert::IsTrue(visit(Describe(), e) == "empty");
+
+         {
+            shared_var_of<int, Tracked> t(Tracked(4));
+            shared_var_of<int, Tracked> copy = t;
+            Assert::IsTrue(Tracked::live == 1);
+
+            Tracked none(0);
+            Assert::IsTrue(&copy.as(none) == &t.as(none));
+
+            shared_var_of<int, Tracked> moved(std::move(copy));
+            Assert::IsTrue(copy.empty() && moved == t);
+            t = 5;
+            Assert::IsTrue(t == 5 && Tracked::live == 2);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(AtomicVarPublish) {
+         {
+            atomic_shared_var cell;
+            Assert::IsTrue(cell.load().empty());
+            cell.store(shared_var(Tracked(1)));
+            Assert::IsTrue(cell.load() == Tracked(1));
+
+            shared_var old = cell.exchange(shared_var(2));
+            Assert::IsTrue(old == Tracked(1) && cell.load() == 2);
+
+            shared_var expected(3);
+            Assert::IsTrue(!cell.compare_exchange(expected, shared_var("no")));
+            Assert::IsTrue(expected == 2);
+            Assert::IsTrue(cell.compare_exchange(expected, shared_var("yes")));
+            Assert::IsTrue(cell.load() == "yes");
+         }
+         Assert::IsTrue(Tracked::live == 0);
+
+         // Readers always see a whole snapshot while a writer replaces it.
+         {
+            atomic_shared_var config(shared_var(std::vector<shared_var>{ shared_var(0), shared_var(0) }));
+            std::atomic<bool> torn(false);
+            std::vector<std::thread> readers;
+            for (int t = 0; t < 4; ++t) {
+               readers.emplace_back([&] {
+                  for (int i = 0; i < 20000; ++i) {
+                     shared_var v = config.load();
+                     const std::vector<shared_var>& pair = v.as<std::vector<shared_var>>();
+                     if (pair.size() != 2 || pair[0] != pair[1]) {
+                        torn = true;
+                     }
+                  }
+               });
+            }
+            for (int version = 1; version <= 2000; ++version) {
+               config.store(shared_var(std::vector<shared_var>{ shared_var(Tracked(version)), shared_var(Tracked(version)) }));
+            }
+            for (std::thread& reader : readers) {
+               reader.join();
+            }
+            Assert::IsTrue(!torn);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(AtomicVarAtNamespaceScope) {
+         Assert::IsTrue(global_config.load() == "boot");
+         std::thread([] { global_config.store(shared_var("running")); }).join();
+         Assert::IsTrue(global_config.exchange(shared_var("ready")) == "running");
+         Assert::IsTrue(global_config.load() == "ready");
+      }
+
+      TEST_METHOD(DeferredReclaim) {
+         {
+            shared_var_reclaimer reclaimer;
+            {
+               shared_var_reclaim_scope scope(&reclaimer);
+               std::vector<shared_var> doc;
+               for (int i = 0; i < 100; ++i) {
+                  doc.push_back(shared_var(Tracked(i)));
+               }
+               shared_var copy = doc[0];
+               doc.clear();
+               Assert::IsTrue(copy == Tracked(0));
+
+               // Not thread-safe, so never deferred.
+               basic_shared_var<local_refcount> local(Tracked(-1));
+               local = nullptr;
+            }
+            reclaimer.drain();
+            Assert::IsTrue(Tracked::live == 0);
+
+            shared_var_reclaimer::stats stats = reclaimer.statistics();
+            Assert::IsTrue(stats.reclaimed == 100 && stats.pending == 0);
+            Assert::IsTrue(stats.max_pending >= 1 && stats.max_pending <= 100);
+            Assert::IsTrue(stats.max_lag <= stats.total_lag);
+         }
+
+         // Whatever is still queued goes with the reclaimer.
+         {
+            shared_var_reclaimer reclaimer;
+            shared_var_reclaim_scope scope(&reclaimer);
+            shared_var dropped(Tracked(1));
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(BiasedRefcountAcrossThreads) {
+         typedef basic_shared_var<biased_refcount> biased_var;
+
+         // Editing a var in place leaves its Tracked where it was only if
+         // nothing else shares the holder.
+         auto unique = [](biased_var& v) {
+            const Tracked * before = v.get_if<Tracked>();
+            return &v.edit<Tracked>() == before;
+         };
+
+         {
+            biased_var v(Tracked(1));
+            biased_var copy = v;
+            copy = nullptr;
+            Assert::IsTrue(unique(v));
+
+            // A copy released on another thread waits for the owner.
+            biased_var escaped = v;
+            int seen = 0;
+            std::thread([&] {
+               biased_var mine = escaped;
+               escaped = nullptr;
+               seen = mine.get<Tracked>().id;
+            }).join();
+            Assert::IsTrue(seen == 1);
+            Assert::IsTrue(Tracked::live == 1);
+            biased_refcount::collect();
+            Assert::IsTrue(unique(v) && Tracked::live == 1);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+
+         // The owner lets go first; the holder is freed when it collects.
+         {
+            biased_var v(Tracked(2));
+            biased_var escaped = v;
+            v = nullptr;
+            std::thread([&] { escaped = nullptr; }).join();
+            Assert::IsTrue(Tracked::live == 1);
+            biased_refcount::collect();
+            Assert::IsTrue(Tracked::live == 0);
+         }
+
+         // Holders outlive the thread that made them.
+         {
+            biased_var escaped;
+            std::thread([&] {
+               biased_var v(Tracked(3));
+               escaped = v;
+            }).join();
+            Assert::IsTrue(escaped.get<Tracked>().id == 3 && Tracked::live == 1);
+            escaped = nullptr;
+            Assert::IsTrue(Tracked::live == 0);
+         }
+
+         // Records of exited threads go with their last holder.
+         {
+            std::vector<biased_var> kept;
+            for (int i = 0; i < 50; ++i) {
+               std::thread([&] {
+                  biased_var v{ Tracked(i) };
+                  biased_var dropped{ Tracked(-1) };
+                  kept.push_back(v);
+               }).join();
+            }
+            Assert::IsTrue(Tracked::live == 50);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(InternPool) {
+         shared_var_intern_pool pool;
+         shared_var a = pool.intern(shared_var("status"));
+         shared_var b = pool.intern(shared_var("status"));
+         shared_var c = pool.intern(shared_var("other"));
+         Assert::IsTrue(a._identical(b) && a == b);
+         Assert::IsTrue(a != c && a == "status");
+         Assert::IsTrue(pool.size() == 2);
+
+         // Same hash, different type.
+         Assert::IsTrue(!pool.intern(shared_var(L"status")).is<std::string>());
+         Assert::IsTrue(pool.intern(shared_var(5))._interned() == nullptr);
+
+         // Vars outside the pool still compare by value.
+         Assert::IsTrue(a == shared_var("status") && shared_var("status") == b);
+
+         // A value edited after interning leaves the pool's alone.
+         shared_var d = b;
+         d.edit<std::string>() = "other";
+         Assert::IsTrue(d == c && !d._identical(c) && b == "status");
+
+         {
+            shared_var t = pool.intern(shared_var(Tracked(1)));
+            Assert::IsTrue(pool.purge() == 1);   // the wide string
+            Assert::IsTrue(t == pool.intern(shared_var(Tracked(1))));
+         }
+         Assert::IsTrue(Tracked::live == 1);
+         Assert::IsTrue(pool.purge() == 1 && Tracked::live == 0);
+
+         pool.clear();
+         Assert::IsTrue(pool.size() == 0 && a._interned() == nullptr && a == b);
+      }
+
+      TEST_METHOD(InternPoolWithoutStdHash) {
+         shared_var_intern_pool pool;
+
+         // Equal unordered sets that list their elements in different orders.
+         std::unordered_set<int> up, down;
+         down.rehash(1024);
+         for (int i = 0; i < 100; ++i) {
+            up.insert(i);
+            down.insert(99 - i);
+         }
+         shared_var a = pool.intern(shared_var(up));
+         shared_var b = pool.intern(shared_var(down));
+         Assert::IsTrue(pool.size() == 1 && a._identical(b) && a == b);
+
+         // No std::hash at all: every Tracked hashes alike.
+         shared_var p = pool.intern(shared_var(Tracked(1)));
+         shared_var q = pool.intern(shared_var(Tracked(1)));
+         shared_var r = pool.intern(shared_var(Tracked(2)));
+         Assert::IsTrue(pool.size() == 3 && p._identical(q) && !p._identical(r));
+         Assert::IsTrue(p == q && p != r && r == shared_var(Tracked(2)));
+      }
+
+      TEST_METHOD(EncodeDecodeDocument) {
+         std::map<std::string, shared_var> obj;
+         obj["int"] = -7;
+         obj["uint"] = 4000000000u;
+         obj["big"] = -1234567890123LL;
+         obj["char"] = 'c';
+         obj["real"] = 0.1;
+         obj["float"] = 2.5f;
+         obj["flag"] = true;
+         obj["text"] = "Hello";
+         obj["wide"] = L"wide \x263A";
+         obj["none"] = nullptr;
+         obj["list"] = std::vector<shared_var>{ shared_var(1), shared_var(""), shared_var(std::vector<shared_var>()) };
+         obj["nested"] = obj;
+         shared_var doc(obj);
+
+         std::size_t size = shared_var_encode(doc, nullptr, 0);
+         std::vector<unsigned char> bytes(size);
+         Assert::IsTrue(shared_var_encode(doc, bytes.data(), size) == size);
+
+         shared_var back = shared_var_decode(bytes.data(), bytes.size());
+         Assert::IsTrue(back == doc);
+         const std::map<std::string, shared_var>& m = back.get<std::map<std::string, shared_var>>();
+         Assert::IsTrue(m.at("int").is<int>() && m.at("uint").is<unsigned int>());
+         Assert::IsTrue(m.at("float").is<float>() && m.at("none").empty());
+
+         // Every wchar_t round-trips, signed or not; a character encodes as
+         // its code point either way.
+         auto round_trip = [](const shared_var& v) {
+            std::vector<unsigned char> out(shared_var_encode(v, nullptr, 0));
+            shared_var_encode(v, out.data(), out.size());
+            return shared_var_decode(out.data(), out.size());
+         };
+         const wchar_t lowest = std::numeric_limits<wchar_t>::min();
+         const wchar_t highest = std::numeric_limits<wchar_t>::max();
+         Assert::IsTrue(round_trip(shared_var(wchar_t(-1))) == shared_var(wchar_t(-1)));
+         Assert::IsTrue(round_trip(shared_var(lowest)) == shared_var(lowest));
+         Assert::IsTrue(round_trip(shared_var(highest)) == shared_var(highest));
+         std::wstring units{ L'a', wchar_t(-1), lowest, highest };
+         Assert::IsTrue(round_trip(shared_var(units)) == shared_var(units));
+         unsigned char letter[2];
+         Assert::IsTrue(shared_var_encode(shared_var(L'A'), letter, sizeof(letter)) == 2);
+         Assert::IsTrue(letter[0] == 5 && letter[1] == 'A');
+
+         // Decoded vars outlive each other and the input in any order.
+         shared_var list = m.at("list");
+         back = nullptr;
+         bytes.clear();
+         Assert::IsTrue(list.get<std::vector<shared_var>>().size() == 3);
+
+         // A short buffer gets a prefix; the size is still the whole.
+         unsigned char small[4];
+         Assert::IsTrue(shared_var_encode(doc, small, sizeof(small)) == size);
+
+         auto format_error = [](auto&& fn) {
+            try {
+               fn();
+            }
+            catch (const bad_shared_var_format&) {
+               return true;
+            }
+            return false;
+         };
+         Assert::IsTrue(format_error([&] { shared_var_encode(shared_var(Tracked(1)), nullptr, 0); }));
+         Assert::IsTrue(format_error([&] { shared_var_encode(shared_var(1.0L), nullptr, 0); }));
+
+         std::vector<unsigned char> encoded(shared_var_encode(doc, nullptr, 0));
+         shared_var_encode(doc, encoded.data(), encoded.size());
+         Assert::IsTrue(format_error([&] { shared_var_decode(encoded.data(), encoded.size() - 1); }));
+         encoded.push_back(0);
+         Assert::IsTrue(format_error([&] { shared_var_decode(encoded.data(), encoded.size()); }));
+         const unsigned char bad_tag[] = { 99 };
+         const unsigned char bad_bool[] = { 1, 2 };
+         const unsigned char huge_count[] = { 19, 0xff, 0xff, 0xff, 0xff, 0x0f };
+         Assert::IsTrue(format_error([&] { shared_var_decode(bad_tag, sizeof(bad_tag)); }));
+         Assert::IsTrue(format_error([&] { shared_var_decode(bad_bool, sizeof(bad_bool)); }));
+         Assert::IsTrue(format_error([&] { shared_var_decode(huge_count, sizeof(huge_count)); }));
+         std::vector<unsigned char> deep;
+         for (int i = 0; i <= shared_var_max_decode_depth + 1; ++i) {
+            deep.push_back(19);
+            deep.push_back(1);
+         }
+         deep.push_back(0);
+         Assert::IsTrue(format_error([&] { shared_var_decode(deep.data(), deep.size()); }));
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(MovesDoNotThrow) {
+         // So growing a std::vector moves vars instead of copying them.
+         Assert::IsTrue(std::is_nothrow_move_constructible<shared_var>::value);
+         Assert::IsTrue(std::is_nothrow_move_assignable<shared_var>::value);
+         Assert::IsTrue(std::is_nothrow_move_constructible<basic_shared_var<local_refcount>>::value);
+      }
+
+      TEST_METHOD(AssignFromOwnChild) {
+         typedef std::map<std::string, shared_var> object;
+
+         // Walking down a tree: the child lives in the value being replaced.
+         object leaf;
+         leaf["name"] = std::string(100, 'x');
+         object root;
+         root["child"] = leaf;
+         shared_var node(root);
+         root.clear();
+         leaf.clear();
+         node = node.get<object>().at("child");
+         Assert::IsTrue(node.get<object>().at("name") == std::string(100, 'x'));
+
+         shared_var list(std::vector<shared_var>{ shared_var(Tracked(7)), shared_var(Tracked(8)) });
+         list = std::move(list.edit<std::vector<shared_var>>()[0]);
+         Assert::IsTrue(Tracked::live == 1);
+         Assert::IsTrue(list == Tracked(7));
+         list = nullptr;
+         Assert::IsTrue(Tracked::live == 0);
+      }
+
+      TEST_METHOD(ClosedSetComparesLikeSharedVar) {
+         typedef shared_var_of<int, std::string> closed;
+
+         // As AssignCompareNull.
+         closed v(nullptr);
+         Assert::IsTrue(v == nullptr);
+         Assert::IsTrue(nullptr == v);
+         Assert::IsTrue(v.empty());
+         v = 3;
+         Assert::IsTrue(v != nullptr && nullptr != v);
+
+         // As TestStrings.
+         closed v1("Hello");
+         closed v2;
+         v2 = v1;
+         v2 = "Goodbye";
+         Assert::IsTrue("Hello" == v1);
+         Assert::IsTrue(v2 == "Goodbye");
+         Assert::IsTrue("Hello" != v2 && v2 != "Hello");
+         Assert::IsTrue(3 == v && v == 3);
+      }
+
+      TEST_METHOD(LocalRefcountMapOfAnys) {
+         typedef basic_shared_var<local_refcount> local_var;
+
+         {
+            std::map<std::string, local_var> obj;
+
+            obj["x"] = 4;
+            obj["y"] = "Hello";
+            obj["t"] = Tracked(3);
+
+            std::map<std::string, local_var> copy = obj;
+            obj.clear();
+
+            Assert::IsTrue(copy["x"] == 4);
+            Assert::IsTrue(copy["y"] == "Hello");
+            Assert::IsTrue(copy["t"] == Tracked(3));
+            Assert::IsTrue(Tracked::live == 1);
+         }
+         Assert::IsTrue(Tracked::live == 0);
+      }
    };
-}
\ No newline at end of file
+}
\ No newline at end of file